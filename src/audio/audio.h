@@ -21,6 +21,12 @@
 
 #include <Limelight.h>
 
+// Target latency in ms passed in arFlags to the SDL audio renderer only, 0 for the default
+#define AUDIO_LATENCY_MASK 0x3FF
+#define AUDIO_DEFAULT_LATENCY 20
+
+extern AUDIO_RENDERER_CALLBACKS audio_callbacks_fake;
+
 #ifdef HAVE_ALSA
 extern AUDIO_RENDERER_CALLBACKS audio_callbacks_alsa;
 #endif
@@ -0,0 +1,96 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2015 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "audio.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <opus_multistream.h>
+
+// Decodes the audio and discards the samples, to measure the client without a sound card
+
+static OpusMSDecoder* decoder;
+static short* pcmBuffer;
+static int samplesPerFrame;
+
+static unsigned int packets_decoded, decode_errors;
+static uint64_t decode_time;
+static uint64_t report_time;
+
+static uint64_t thread_cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int fake_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
+  int rc;
+  decoder = opus_multistream_decoder_create(opusConfig->sampleRate, opusConfig->channelCount, opusConfig->streams, opusConfig->coupledStreams, opusConfig->mapping, &rc);
+  if (decoder == NULL) {
+    fprintf(stderr, "Couldn't create Opus decoder: %d\n", rc);
+    return -1;
+  }
+
+  samplesPerFrame = opusConfig->samplesPerFrame;
+  pcmBuffer = malloc(sizeof(short) * opusConfig->channelCount * samplesPerFrame);
+  if (pcmBuffer == NULL)
+    return -1;
+
+  packets_decoded = decode_errors = 0;
+  decode_time = 0;
+  report_time = LiGetMillis();
+  return 0;
+}
+
+static void fake_renderer_cleanup() {
+  if (decoder != NULL) {
+    opus_multistream_decoder_destroy(decoder);
+    decoder = NULL;
+  }
+
+  if (pcmBuffer != NULL) {
+    free(pcmBuffer);
+    pcmBuffer = NULL;
+  }
+}
+
+static void fake_renderer_decode_and_play_sample(char* data, int length) {
+  uint64_t start = thread_cpu_ns();
+  if (opus_multistream_decode(decoder, (unsigned char*) data, length, pcmBuffer, samplesPerFrame, 0) < 0)
+    decode_errors++;
+  decode_time += thread_cpu_ns() - start;
+  packets_decoded++;
+
+  uint64_t now = LiGetMillis();
+  if (now - report_time >= 1000) {
+    printf("Audio: %u packets decoded, %.3f ms CPU per packet, %d packets pending, %u errors\n", packets_decoded, decode_time / 1000000.0 / packets_decoded, LiGetPendingAudioFrames(), decode_errors);
+    packets_decoded = decode_errors = 0;
+    decode_time = 0;
+    report_time = now;
+  }
+}
+
+AUDIO_RENDERER_CALLBACKS audio_callbacks_fake = {
+  .init = fake_renderer_init,
+  .cleanup = fake_renderer_cleanup,
+  .decodeAndPlaySample = fake_renderer_decode_and_play_sample,
+  .capabilities = CAPABILITY_DIRECT_SUBMIT | CAPABILITY_SUPPORTS_ARBITRARY_AUDIO_DURATION,
+};
@@ -23,14 +23,71 @@
 #include <SDL_audio.h>
 
 #include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
 #include <opus_multistream.h>
 
+// An underrun raises the target latency by a packet, it drops back a packet after this long without one
+#define LATENCY_DECAY_MS 10000
+#define MAX_LATENCY_FACTOR 4
+
 static OpusMSDecoder* decoder;
 static short* pcmBuffer;
 static int samplesPerFrame;
 static SDL_AudioDeviceID dev;
 static int channelCount;
 
+// Decoded samples are passed to the audio callback through a single producer, single consumer ring,
+// all sizes count interleaved samples
+static short* ring;
+static unsigned int ring_size;
+static unsigned int ring_head, ring_tail;
+
+static unsigned int target_samples, min_target_samples, max_target_samples;
+static unsigned int sample_rate;
+static bool playing;
+static Uint32 last_target_change;
+static unsigned int underruns, packets_dropped;
+
+static void sdl_audio_callback(void* userdata, Uint8* stream, int len) {
+  short* out = (short*) stream;
+  unsigned int wanted = len / sizeof(short);
+  unsigned int tail = ring_tail;
+  unsigned int available = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) - tail;
+  unsigned int target = __atomic_load_n(&target_samples, __ATOMIC_RELAXED);
+
+  // Start playing only when the ring holds the target latency, to absorb network jitter
+  if (!playing && available >= target)
+    playing = true;
+
+  unsigned int count = 0;
+  if (playing) {
+    count = available < wanted ? available : wanted;
+    unsigned int offset = tail & (ring_size - 1);
+    unsigned int first = count < ring_size - offset ? count : ring_size - offset;
+    memcpy(out, ring + offset, first * sizeof(short));
+    memcpy(out + first, ring, (count - first) * sizeof(short));
+    __atomic_store_n(&ring_tail, tail + count, __ATOMIC_RELEASE);
+
+    Uint32 now = SDL_GetTicks();
+    if (count < wanted) {
+      playing = false;
+      underruns++;
+      if (target < max_target_samples) {
+        __atomic_store_n(&target_samples, target + samplesPerFrame * channelCount, __ATOMIC_RELAXED);
+        last_target_change = now;
+      }
+    } else if (target > min_target_samples && now - last_target_change > LATENCY_DECAY_MS) {
+      __atomic_store_n(&target_samples, target - samplesPerFrame * channelCount, __ATOMIC_RELAXED);
+      last_target_change = now;
+    }
+  }
+
+  memset(out + count, 0, (wanted - count) * sizeof(short));
+}
+
+static void sdl_renderer_cleanup();
+
 static int sdl_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
   int rc;
   decoder = opus_multistream_decoder_create(opusConfig->sampleRate, opusConfig->channelCount, opusConfig->streams, opusConfig->coupledStreams, opusConfig->mapping, &rc);
@@ -38,8 +95,40 @@ static int sdl_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURA
   channelCount = opusConfig->channelCount;
   samplesPerFrame = opusConfig->samplesPerFrame;
   pcmBuffer = malloc(sizeof(short) * channelCount * samplesPerFrame);
-  if (pcmBuffer == NULL)
+  if (pcmBuffer == NULL) {
+    sdl_renderer_cleanup();
     return -1;
+  }
+
+  int latency = arFlags & AUDIO_LATENCY_MASK;
+  if (latency == 0)
+    latency = AUDIO_DEFAULT_LATENCY;
+
+  sample_rate = opusConfig->sampleRate;
+  unsigned int target_frames = sample_rate * latency / 1000;
+  if (target_frames < samplesPerFrame)
+    target_frames = samplesPerFrame;
+  min_target_samples = target_samples = target_frames * channelCount;
+  max_target_samples = min_target_samples * MAX_LATENCY_FACTOR;
+
+  // Packets are dropped before the ring holds more than a packet above the target latency
+  ring_size = 1;
+  while (ring_size < max_target_samples + 2 * samplesPerFrame * channelCount)
+    ring_size <<= 1;
+  ring = malloc(sizeof(short) * ring_size);
+  if (ring == NULL) {
+    sdl_renderer_cleanup();
+    return -1;
+  }
+  ring_head = ring_tail = 0;
+  playing = false;
+  underruns = packets_dropped = 0;
+  last_target_change = SDL_GetTicks();
+
+  // The device buffer adds to the latency, keep it at most half the target
+  Uint16 device_samples = 64;
+  while (device_samples * 4 <= target_frames && device_samples < 4096)
+    device_samples <<= 1;
 
   SDL_InitSubSystem(SDL_INIT_AUDIO);
 
@@ -48,11 +137,13 @@ static int sdl_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURA
   want.freq = opusConfig->sampleRate;
   want.format = AUDIO_S16LSB;
   want.channels = opusConfig->channelCount;
-  want.samples = 4096;
+  want.samples = device_samples;
+  want.callback = sdl_audio_callback;
 
   dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
   if (dev == 0) {
     printf("Failed to open audio: %s\n", SDL_GetError());
+    sdl_renderer_cleanup();
     return -1;
   } else {
     SDL_PauseAudioDevice(dev, 0);  // start audio playing.
@@ -62,6 +153,13 @@ static int sdl_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURA
 }
 
 static void sdl_renderer_cleanup() {
+  if (dev != 0) {
+    SDL_CloseAudioDevice(dev);
+    dev = 0;
+
+    printf("SDL audio: %u underruns, %u packets dropped, %u ms target latency\n", underruns, packets_dropped, target_samples / channelCount * 1000 / sample_rate);
+  }
+
   if (decoder != NULL) {
     opus_multistream_decoder_destroy(decoder);
     decoder = NULL;
@@ -72,16 +170,31 @@ static void sdl_renderer_cleanup() {
     pcmBuffer = NULL;
   }
 
-  if (dev != 0) {
-    SDL_CloseAudioDevice(dev);
-    dev = 0;
+  if (ring != NULL) {
+    free(ring);
+    ring = NULL;
   }
 }
 
 static void sdl_renderer_decode_and_play_sample(char* data, int length) {
   int decodeLen = opus_multistream_decode(decoder, data, length, pcmBuffer, samplesPerFrame, 0);
   if (decodeLen > 0) {
-    SDL_QueueAudio(dev, pcmBuffer, decodeLen * channelCount * sizeof(short));
+    unsigned int count = decodeLen * channelCount;
+    unsigned int head = ring_head;
+    unsigned int fill = head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+
+    // Drop the packet instead of letting the latency grow when audio arrives faster than it is played,
+    // the ring holds at most the target latency plus the packet being played
+    if (fill + count > __atomic_load_n(&target_samples, __ATOMIC_RELAXED) + samplesPerFrame * channelCount) {
+      packets_dropped++;
+      return;
+    }
+
+    unsigned int offset = head & (ring_size - 1);
+    unsigned int first = count < ring_size - offset ? count : ring_size - offset;
+    memcpy(ring + offset, pcmBuffer, first * sizeof(short));
+    memcpy(ring, pcmBuffer + first, (count - first) * sizeof(short));
+    __atomic_store_n(&ring_head, head + count, __ATOMIC_RELEASE);
   } else if (decodeLen < 0) {
     printf("Opus error from decode: %d\n", decodeLen);
   }
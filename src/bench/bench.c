@@ -0,0 +1,388 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2015 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stream.h"
+#include "headless.h"
+
+#include "../video/video.h"
+#include "../video/ffmpeg.h"
+#ifdef HAVE_X11
+#include "../video/egl.h"
+#endif
+#ifdef HAVE_X11
+#include "../connection.h"
+#include "../loop.h"
+#endif
+#ifdef HAVE_SDL
+#include "../sdl.h"
+#endif
+
+#include <Limelight.h>
+
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum renderers { RENDERER_FAKE, RENDERER_HEADLESS, RENDERER_X11, RENDERER_SDL };
+
+static struct option long_options[] = {
+  {"renderer", required_argument, NULL, 'r'},
+  {"codec", required_argument, NULL, 'c'},
+  {"width", required_argument, NULL, 'w'},
+  {"height", required_argument, NULL, 'h'},
+  {"fps", required_argument, NULL, 'f'},
+  {"unthrottled", no_argument, NULL, 'u'},
+  {"decodequeue", required_argument, NULL, 'q'},
+  {"pacing", no_argument, NULL, 'p'},
+  {0, 0, 0, 0},
+};
+
+static BENCH_STREAM stream;
+static PDECODER_RENDERER_CALLBACKS callbacks;
+static enum renderers renderer = RENDERER_FAKE;
+static int fps = 60;
+static bool unthrottled;
+static bool stopping;
+
+static uint64_t* submit_start;
+static uint64_t* submit_latency;
+static uint64_t* decode_latency;
+static int submitted, dropped, idr_requests, decoded;
+static uint64_t feed_start, feed_end, last_decoded;
+
+static uint64_t *upload_time, *draw_time, *swap_time;
+static int drawn;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_frame_decoded(int frameNumber) {
+  if (frameNumber < 1 || frameNumber > stream.count)
+    return;
+
+  // Runs on the decode thread when there is one
+  last_decoded = now_ns();
+  decode_latency[__atomic_fetch_add(&decoded, 1, __ATOMIC_RELEASE)] = last_decoded - submit_start[frameNumber - 1];
+}
+
+#ifdef HAVE_X11
+static void bench_frame_drawn(uint64_t upload_ns, uint64_t draw_ns, uint64_t swap_ns) {
+  if (drawn >= stream.count)
+    return;
+
+  upload_time[drawn] = upload_ns;
+  draw_time[drawn] = draw_ns;
+  swap_time[drawn] = swap_ns;
+  drawn++;
+}
+#endif
+
+// Submits the units the way moonlight-common-c does, dropping everything
+// until the next IDR frame after the renderer asked for one
+static void* bench_feed(void* data) {
+  struct timespec next;
+  long interval = 1000000000L / fps;
+  bool waiting_for_idr = false;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  feed_start = now_ns();
+  for (int i = 0; i < stream.count && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE); i++) {
+    if (!unthrottled) {
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+      next.tv_nsec += interval;
+      if (next.tv_nsec >= 1000000000) {
+        next.tv_nsec -= 1000000000;
+        next.tv_sec++;
+      }
+    }
+
+    PDECODE_UNIT unit = &stream.units[i];
+    if (waiting_for_idr && unit->frameType != FRAME_TYPE_IDR) {
+      dropped++;
+      continue;
+    }
+    waiting_for_idr = false;
+
+    unit->frameNumber = i + 1;
+    unit->receiveTimeMs = unit->enqueueTimeMs = LiGetMillis();
+    unit->presentationTimeMs = (uint64_t) i * 1000 / fps;
+
+    submit_start[i] = now_ns();
+    int ret = callbacks->submitDecodeUnit(unit);
+    submit_latency[submitted++] = now_ns() - submit_start[i];
+
+    if (ret == DR_NEED_IDR) {
+      idr_requests++;
+      waiting_for_idr = true;
+    }
+  }
+  feed_end = now_ns();
+
+  // Let the renderer main loop return
+  #ifdef HAVE_X11
+  if (renderer == RENDERER_X11)
+    pthread_kill(main_thread_id, SIGTERM);
+  #endif
+  #ifdef HAVE_SDL
+  if (renderer == RENDERER_SDL) {
+    SDL_Event event;
+    event.type = SDL_QUIT;
+    SDL_PushEvent(&event);
+  }
+  #endif
+
+  return NULL;
+}
+
+static int compare_latency(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+static void print_percentiles(const char* name, uint64_t* latency, int count) {
+  if (count == 0)
+    return;
+
+  qsort(latency, count, sizeof(uint64_t), compare_latency);
+  printf("%s (ms): p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n", name, latency[count / 2] / 1e6,
+         latency[count * 9 / 10] / 1e6, latency[count * 99 / 100] / 1e6, latency[count - 1] / 1e6);
+}
+
+static void help() {
+  printf("Usage: moonlight-bench (options) <file>\n");
+  printf("\nDecodes an H.264/HEVC Annex-B or AV1 OBU/IVF file through a video renderer\n\n");
+  printf("\t-renderer <renderer>\tRenderer to use: fake/egl/x11/sdl (default fake, decode without display)\n");
+  printf("\t\t\t\tegl draws into an offscreen surface and reports the upload, draw and swap times\n");
+  printf("\t-codec <codec>\t\tCodec of the file: h264/h265/hevc/av1 (default from file extension)\n");
+  printf("\t-width <width>\t\tHorizontal resolution (default 1280)\n");
+  printf("\t-height <height>\tVertical resolution (default 720)\n");
+  printf("\t-fps <fps>\t\tRate to submit frames at (default 60)\n");
+  printf("\t-unthrottled\t\tSubmit frames as fast as the renderer accepts them\n");
+  printf("\t-decodequeue <depth>\tDecode on a separate thread with a queue of <depth> frames\n");
+  printf("\t-pacing\t\t\tPace frames from their timestamps\n");
+  exit(0);
+}
+
+int main(int argc, char* argv[]) {
+  int width = 1280, height = 720;
+  int videoFormat = 0;
+  int drFlags = 0, queue;
+  char* path = NULL;
+
+  int option_index = 0;
+  int c;
+  while ((c = getopt_long_only(argc, argv, "-r:c:w:h:f:uq:p", long_options, &option_index)) != -1) {
+    switch (c) {
+    case 'r':
+      if (strcmp(optarg, "fake") == 0)
+        renderer = RENDERER_FAKE;
+      #ifdef HAVE_X11
+      else if (strcmp(optarg, "egl") == 0)
+        renderer = RENDERER_HEADLESS;
+      else if (strcmp(optarg, "x11") == 0)
+        renderer = RENDERER_X11;
+      #endif
+      #ifdef HAVE_SDL
+      else if (strcmp(optarg, "sdl") == 0)
+        renderer = RENDERER_SDL;
+      #endif
+      else {
+        fprintf(stderr, "Renderer '%s' not supported\n", optarg);
+        exit(-1);
+      }
+      break;
+    case 'c':
+      if (strcasecmp(optarg, "h264") == 0)
+        videoFormat = VIDEO_FORMAT_H264;
+      else if (strcasecmp(optarg, "h265") == 0 || strcasecmp(optarg, "hevc") == 0)
+        videoFormat = VIDEO_FORMAT_H265;
+      else if (strcasecmp(optarg, "av1") == 0)
+        videoFormat = VIDEO_FORMAT_AV1_MAIN8;
+      else {
+        fprintf(stderr, "Unknown codec '%s'\n", optarg);
+        help();
+      }
+      break;
+    case 'w':
+      width = atoi(optarg);
+      if (width <= 0) {
+        fprintf(stderr, "Width must be positive\n");
+        help();
+      }
+      break;
+    case 'h':
+      height = atoi(optarg);
+      if (height <= 0) {
+        fprintf(stderr, "Height must be positive\n");
+        help();
+      }
+      break;
+    case 'f':
+      fps = atoi(optarg);
+      break;
+    case 'u':
+      unthrottled = true;
+      break;
+    case 'q':
+      queue = atoi(optarg);
+      if (queue < 0 || queue > DECODE_QUEUE_MAX) {
+        fprintf(stderr, "Decode queue depth must be between 0 and %d\n", DECODE_QUEUE_MAX);
+        help();
+      }
+      drFlags = (drFlags & ~DECODE_QUEUE_MASK) | (queue << DECODE_QUEUE_SHIFT);
+      break;
+    case 'p':
+      drFlags |= FRAME_PACING;
+      break;
+    case 1:
+      path = optarg;
+      break;
+    default:
+      help();
+    }
+  }
+
+  if (path == NULL || fps <= 0)
+    help();
+
+  if (videoFormat == 0 && (videoFormat = stream_format(path)) == 0) {
+    fprintf(stderr, "Can't detect the codec of %s, use -codec\n", path);
+    exit(-1);
+  }
+
+  if (stream_open(path, videoFormat, &stream) < 0)
+    exit(-1);
+
+  printf("Loaded %d frames from %s\n", stream.count, path);
+
+  submit_start = calloc(stream.count, sizeof(uint64_t));
+  submit_latency = calloc(stream.count, sizeof(uint64_t));
+  decode_latency = calloc(stream.count, sizeof(uint64_t));
+  upload_time = calloc(stream.count, sizeof(uint64_t));
+  draw_time = calloc(stream.count, sizeof(uint64_t));
+  swap_time = calloc(stream.count, sizeof(uint64_t));
+  if (submit_start == NULL || submit_latency == NULL || decode_latency == NULL || upload_time == NULL || draw_time == NULL || swap_time == NULL) {
+    fprintf(stderr, "Not enough memory\n");
+    exit(-1);
+  }
+
+  switch (renderer) {
+  case RENDERER_FAKE:
+    callbacks = &decoder_callbacks_fake;
+    fake_frame_handler = bench_frame_decoded;
+    break;
+  #ifdef HAVE_X11
+  case RENDERER_HEADLESS:
+    callbacks = &decoder_callbacks_headless;
+    headless_frame_handler = bench_frame_decoded;
+    egl_timing_handler = bench_frame_drawn;
+    break;
+  case RENDERER_X11:
+    if (x11_init(false, false) != INIT_EGL) {
+      fprintf(stderr, "Can't open X display\n");
+      exit(-1);
+    }
+    loop_init();
+    callbacks = &decoder_callbacks_x11;
+    egl_timing_handler = bench_frame_drawn;
+    break;
+  #endif
+  #ifdef HAVE_SDL
+  case RENDERER_SDL:
+    sdl_init(width, height, false, VSYNC_DEFAULT);
+    callbacks = &decoder_callbacks_sdl;
+    break;
+  #endif
+  }
+
+  if (callbacks->setup(videoFormat, width, height, fps, NULL, drFlags) < 0) {
+    fprintf(stderr, "Couldn't set up renderer\n");
+    exit(-1);
+  }
+  if (callbacks->start)
+    callbacks->start();
+
+  if (renderer == RENDERER_FAKE || renderer == RENDERER_HEADLESS)
+    bench_feed(NULL);
+  else {
+    pthread_t feed_thread;
+    pthread_create(&feed_thread, NULL, bench_feed, NULL);
+
+    // Rendering has to happen on the main thread
+    #ifdef HAVE_X11
+    if (renderer == RENDERER_X11)
+      loop_main();
+    #endif
+    #ifdef HAVE_SDL
+    if (renderer == RENDERER_SDL)
+      sdl_loop();
+    #endif
+
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    pthread_join(feed_thread, NULL);
+  }
+
+  // Give a decode thread the chance to finish the queued units
+  if ((renderer == RENDERER_FAKE || renderer == RENDERER_HEADLESS) && (drFlags & DECODE_QUEUE_MASK)) {
+    int last = -1;
+    while (__atomic_load_n(&decoded, __ATOMIC_ACQUIRE) != last) {
+      last = __atomic_load_n(&decoded, __ATOMIC_ACQUIRE);
+      usleep(50000);
+    }
+  }
+
+  if (callbacks->stop)
+    callbacks->stop();
+  callbacks->cleanup();
+
+  #ifdef HAVE_SDL
+  if (renderer == RENDERER_SDL)
+    sdl_destroy();
+  #endif
+
+  double elapsed = (feed_end - feed_start) / 1e9;
+  printf("Submitted %d of %d frames in %.2f s (%.1f fps)\n", submitted, stream.count, elapsed, submitted / elapsed);
+  if (idr_requests > 0)
+    printf("%d IDR frames requested, %d frames dropped waiting for them\n", idr_requests, dropped);
+  print_percentiles("Submit latency", submit_latency, submitted);
+
+  if (renderer == RENDERER_FAKE || renderer == RENDERER_HEADLESS) {
+    double decode_elapsed = decoded > 0 ? (last_decoded - feed_start) / 1e9 : 0;
+    printf("Decoded %d frames in %.2f s (%.1f fps), %d submitted frames not shown\n", decoded, decode_elapsed,
+           decoded > 0 ? decoded / decode_elapsed : 0, submitted - decoded);
+    print_percentiles("Decode latency", decode_latency, decoded);
+  }
+
+  print_percentiles("Upload time", upload_time, drawn);
+  print_percentiles("Draw time", draw_time, drawn);
+  print_percentiles("Swap time", swap_time, drawn);
+
+  stream_close(&stream);
+  return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2015 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "headless.h"
+
+#include "../video/video.h"
+#include "../video/ffmpeg.h"
+#include "../video/egl.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+static PFFMPEG_CONTEXT decoder;
+static int queue_depth;
+static bool egl_active;
+
+void (*headless_frame_handler)(int frameNumber);
+
+// Draws on the thread which decoded the frame, the EGL context becomes current there
+static void headless_frame_decoded(PFFMPEG_CONTEXT ctx) {
+  AVFrame* frame = ffmpeg_get_frame(ctx, true);
+  if (frame == NULL)
+    return;
+
+  egl_draw(frame);
+  if (headless_frame_handler != NULL)
+    headless_frame_handler(ffmpeg_frame_number(frame));
+}
+
+static void headless_cleanup();
+
+static int headless_setup(int videoFormat, int width, int height, int redrawRate, void* context, int drFlags) {
+  int thread_count;
+  int avc_flags = ffmpeg_threading(videoFormat, width, height, redrawRate, &thread_count);
+  decoder = ffmpeg_init(videoFormat, width, height, avc_flags, 2, thread_count, context, NULL);
+  if (decoder == NULL) {
+    fprintf(stderr, "Couldn't initialize video decoding\n");
+    return -1;
+  } else if (ffmpeg_get_decoder(decoder) != SOFTWARE) {
+    fprintf(stderr, "The headless renderer only draws software decoded frames\n");
+    headless_cleanup();
+    return -1;
+  }
+
+  egl_init_headless(width, height);
+  egl_active = true;
+
+  queue_depth = (drFlags & DECODE_QUEUE_MASK) >> DECODE_QUEUE_SHIFT;
+  if (queue_depth > 0 && ffmpeg_start_decode_thread(decoder, queue_depth, headless_frame_decoded) < 0) {
+    fprintf(stderr, "Couldn't start decode thread\n");
+    headless_cleanup();
+    return -1;
+  }
+
+  return 0;
+}
+
+static void headless_cleanup() {
+  ffmpeg_destroy(decoder);
+  decoder = NULL;
+
+  if (egl_active) {
+    egl_destroy();
+    egl_active = false;
+  }
+}
+
+static int headless_submit_decode_unit(PDECODE_UNIT decodeUnit) {
+  if (queue_depth > 0)
+    return ffmpeg_queue_decode_unit(decoder, decodeUnit);
+
+  int ret = ffmpeg_decode_unit(decoder, decodeUnit);
+  headless_frame_decoded(decoder);
+
+  return ret;
+}
+
+DECODER_RENDERER_CALLBACKS decoder_callbacks_headless = {
+  .setup = headless_setup,
+  .cleanup = headless_cleanup,
+  .submitDecodeUnit = headless_submit_decode_unit,
+  .capabilities = CAPABILITY_REFERENCE_FRAME_INVALIDATION_AVC | CAPABILITY_REFERENCE_FRAME_INVALIDATION_HEVC | CAPABILITY_REFERENCE_FRAME_INVALIDATION_AV1 | CAPABILITY_DIRECT_SUBMIT,
+};
@@ -0,0 +1,329 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2015 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stream.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define OBU_SEQUENCE_HEADER 1
+#define OBU_TEMPORAL_DELIMITER 2
+
+// Units and entries are collected by index first, as the arrays move while growing
+struct unit_builder {
+  PBENCH_STREAM stream;
+  int units_size, entries_size, entries_count;
+  int* first_entry;
+  bool unit_open, unit_has_picture;
+};
+
+static bool builder_add_unit(struct unit_builder* builder) {
+  PBENCH_STREAM stream = builder->stream;
+  if (stream->count == builder->units_size) {
+    builder->units_size = builder->units_size > 0 ? builder->units_size * 2 : 1024;
+    stream->units = realloc(stream->units, builder->units_size * sizeof(DECODE_UNIT));
+    builder->first_entry = realloc(builder->first_entry, (builder->units_size + 1) * sizeof(int));
+    if (stream->units == NULL || builder->first_entry == NULL)
+      return false;
+  }
+
+  memset(&stream->units[stream->count], 0, sizeof(DECODE_UNIT));
+  stream->units[stream->count].frameType = FRAME_TYPE_PFRAME;
+  builder->first_entry[stream->count] = builder->entries_count;
+  stream->count++;
+  builder->unit_open = true;
+  builder->unit_has_picture = false;
+  return true;
+}
+
+static bool builder_add_entry(struct unit_builder* builder, char* data, int length, int bufferType) {
+  PBENCH_STREAM stream = builder->stream;
+  if (!builder->unit_open && !builder_add_unit(builder))
+    return false;
+
+  if (builder->entries_count == builder->entries_size) {
+    builder->entries_size = builder->entries_size > 0 ? builder->entries_size * 2 : 4096;
+    stream->entries = realloc(stream->entries, builder->entries_size * sizeof(LENTRY));
+    if (stream->entries == NULL)
+      return false;
+  }
+
+  PLENTRY entry = &stream->entries[builder->entries_count++];
+  entry->next = NULL;
+  entry->data = data;
+  entry->length = length;
+  entry->bufferType = bufferType;
+  stream->units[stream->count - 1].fullLength += length;
+  return true;
+}
+
+static void builder_finish(struct unit_builder* builder) {
+  PBENCH_STREAM stream = builder->stream;
+  builder->first_entry[stream->count] = builder->entries_count;
+  for (int i = 0; i < stream->count; i++) {
+    int first = builder->first_entry[i], last = builder->first_entry[i + 1];
+    for (int j = first; j < last - 1; j++)
+      stream->entries[j].next = &stream->entries[j + 1];
+
+    stream->units[i].bufferList = last > first ? &stream->entries[first] : NULL;
+  }
+  free(builder->first_entry);
+}
+
+static size_t find_start_code(const uint8_t* data, size_t size, size_t offset) {
+  for (size_t i = offset; i + 3 <= size; i++) {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+      return i;
+  }
+  return size;
+}
+
+// Groups NAL units into access units, each NAL unit keeps its start code like the host sends it
+static bool split_annexb(struct unit_builder* builder, uint8_t* data, size_t size, bool hevc) {
+  size_t start = find_start_code(data, size, 0);
+  while (start < size) {
+    size_t next = find_start_code(data, size, start + 3);
+    size_t end = next;
+    // The zero byte of a four byte start code belongs to the next NAL unit
+    if (end < size && end > start && data[end - 1] == 0)
+      end--;
+
+    size_t header = start + 3;
+    if (start > 0 && data[start - 1] == 0)
+      start--;
+
+    if (header + (hevc ? 2 : 1) >= end) {
+      start = next;
+      continue;
+    }
+
+    int type, bufferType = BUFFER_TYPE_PICDATA;
+    bool vcl, first_slice = false, key_frame = false;
+    if (hevc) {
+      type = (data[header] >> 1) & 0x3F;
+      vcl = type < 32;
+      if (vcl) {
+        first_slice = data[header + 2] & 0x80;
+        key_frame = type >= 16 && type <= 21;
+      } else if (type == 32)
+        bufferType = BUFFER_TYPE_VPS;
+      else if (type == 33)
+        bufferType = BUFFER_TYPE_SPS;
+      else if (type == 34)
+        bufferType = BUFFER_TYPE_PPS;
+    } else {
+      type = data[header] & 0x1F;
+      vcl = type >= 1 && type <= 5;
+      if (vcl) {
+        // first_mb_in_slice is zero when its Exp-Golomb code starts with a one
+        first_slice = data[header + 1] & 0x80;
+        key_frame = type == 5;
+      } else if (type == 7)
+        bufferType = BUFFER_TYPE_SPS;
+      else if (type == 8)
+        bufferType = BUFFER_TYPE_PPS;
+    }
+
+    // Parameter sets, SEI and delimiters after a picture or the first slice of the next one start a new access unit
+    if (builder->unit_open && builder->unit_has_picture && (!vcl || first_slice))
+      builder->unit_open = false;
+
+    if (!builder_add_entry(builder, (char*) data + start, end - start, bufferType))
+      return false;
+
+    if (vcl) {
+      builder->unit_has_picture = true;
+      if (key_frame)
+        builder->stream->units[builder->stream->count - 1].frameType = FRAME_TYPE_IDR;
+    }
+
+    start = next;
+  }
+
+  return true;
+}
+
+static bool read_leb128(const uint8_t* data, size_t size, size_t* offset, uint64_t* value) {
+  *value = 0;
+  for (int i = 0; i < 8; i++) {
+    if (*offset >= size)
+      return false;
+
+    uint8_t byte = data[(*offset)++];
+    *value |= (uint64_t) (byte & 0x7F) << (i * 7);
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// Returns the length of the OBUs in a temporal unit and whether it starts a new sequence
+static bool parse_obus(const uint8_t* data, size_t size, size_t offset, size_t* end, bool* key_frame, bool* delimiter) {
+  uint8_t header = data[offset];
+  int type = (header >> 3) & 0xF;
+  size_t payload = offset + 1 + ((header >> 2) & 1);
+  uint64_t obu_size;
+
+  // The low overhead format requires every OBU to carry its size
+  if (!(header & 0x2) || !read_leb128(data, size, &payload, &obu_size) || payload + obu_size > size)
+    return false;
+
+  *end = payload + obu_size;
+  *key_frame = type == OBU_SEQUENCE_HEADER;
+  *delimiter = type == OBU_TEMPORAL_DELIMITER;
+  return true;
+}
+
+static bool split_obu(struct unit_builder* builder, uint8_t* data, size_t size) {
+  size_t offset = 0;
+  while (offset < size) {
+    size_t end;
+    bool key_frame, delimiter;
+    if (!parse_obus(data, size, offset, &end, &key_frame, &delimiter)) {
+      fprintf(stderr, "Invalid OBU at offset %zu\n", offset);
+      return false;
+    }
+
+    if (delimiter)
+      builder->unit_open = false;
+
+    if (!builder_add_entry(builder, (char*) data + offset, end - offset, BUFFER_TYPE_PICDATA))
+      return false;
+
+    if (key_frame)
+      builder->stream->units[builder->stream->count - 1].frameType = FRAME_TYPE_IDR;
+
+    offset = end;
+  }
+
+  return true;
+}
+
+static bool split_ivf(struct unit_builder* builder, uint8_t* data, size_t size) {
+  if (size < 32 || memcmp(data + 8, "AV01", 4) != 0) {
+    fprintf(stderr, "Only AV1 is supported in IVF files\n");
+    return false;
+  }
+
+  size_t offset = data[6] | data[7] << 8;
+  while (offset + 12 <= size) {
+    size_t frame_size = data[offset] | data[offset + 1] << 8 | data[offset + 2] << 16 | (size_t) data[offset + 3] << 24;
+    offset += 12;
+    if (offset + frame_size > size)
+      break;
+
+    // Every IVF frame holds a complete temporal unit
+    builder->unit_open = false;
+    if (!builder_add_entry(builder, (char*) data + offset, frame_size, BUFFER_TYPE_PICDATA))
+      return false;
+
+    size_t obu = offset, end;
+    bool key_frame, delimiter;
+    while (obu < offset + frame_size && parse_obus(data, offset + frame_size, obu, &end, &key_frame, &delimiter)) {
+      if (key_frame)
+        builder->stream->units[builder->stream->count - 1].frameType = FRAME_TYPE_IDR;
+      obu = end;
+    }
+
+    offset += frame_size;
+  }
+
+  return true;
+}
+
+int stream_format(const char* path) {
+  const char* extension = strrchr(path, '.');
+  if (extension == NULL)
+    return 0;
+
+  extension++;
+  if (strcasecmp(extension, "h264") == 0 || strcasecmp(extension, "264") == 0)
+    return VIDEO_FORMAT_H264;
+  else if (strcasecmp(extension, "h265") == 0 || strcasecmp(extension, "265") == 0 || strcasecmp(extension, "hevc") == 0)
+    return VIDEO_FORMAT_H265;
+  else if (strcasecmp(extension, "obu") == 0 || strcasecmp(extension, "av1") == 0 || strcasecmp(extension, "ivf") == 0)
+    return VIDEO_FORMAT_AV1_MAIN8;
+
+  return 0;
+}
+
+int stream_open(const char* path, int videoFormat, PBENCH_STREAM stream) {
+  memset(stream, 0, sizeof(BENCH_STREAM));
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Can't open %s\n", path);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    fprintf(stderr, "Can't read %s\n", path);
+    close(fd);
+    return -1;
+  }
+
+  // Map privately, as the buffers handed to the decoder aren't const
+  stream->size = st.st_size;
+  stream->data = mmap(NULL, stream->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (stream->data == MAP_FAILED) {
+    stream->data = NULL;
+    fprintf(stderr, "Can't map %s\n", path);
+    return -1;
+  }
+
+  stream->videoFormat = videoFormat;
+  struct unit_builder builder = { .stream = stream };
+  bool ok;
+  if (videoFormat & VIDEO_FORMAT_MASK_AV1) {
+    if (stream->size >= 4 && memcmp(stream->data, "DKIF", 4) == 0)
+      ok = split_ivf(&builder, stream->data, stream->size);
+    else
+      ok = split_obu(&builder, stream->data, stream->size);
+  } else
+    ok = split_annexb(&builder, stream->data, stream->size, videoFormat & VIDEO_FORMAT_MASK_H265);
+
+  if (!ok || stream->count == 0) {
+    fprintf(stderr, "No frames found in %s\n", path);
+    free(builder.first_entry);
+    stream_close(stream);
+    return -1;
+  }
+  builder_finish(&builder);
+
+  return 0;
+}
+
+void stream_close(PBENCH_STREAM stream) {
+  if (stream->data != NULL)
+    munmap(stream->data, stream->size);
+
+  free(stream->units);
+  free(stream->entries);
+  memset(stream, 0, sizeof(BENCH_STREAM));
+}
@@ -0,0 +1,36 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2015 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Limelight.h>
+
+#include <stddef.h>
+
+// Decode units split from an elementary stream file, the buffers point into the mapped file
+typedef struct _BENCH_STREAM {
+  int videoFormat;
+  int count;
+  PDECODE_UNIT units;
+  PLENTRY entries;
+  void* data;
+  size_t size;
+} BENCH_STREAM, *PBENCH_STREAM;
+
+int stream_format(const char* path);
+int stream_open(const char* path, int videoFormat, PBENCH_STREAM stream);
+void stream_close(PBENCH_STREAM stream);
@@ -24,6 +24,7 @@
 
 #include "input/evdev.h"
 #include "audio/audio.h"
+#include "video/video.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -77,6 +78,14 @@ static struct option long_options[] = {
   {"pin", required_argument, NULL, '5'},
   {"port", required_argument, NULL, '6'},
   {"hdr", no_argument, NULL, '7'},
+  {"decodequeue", required_argument, NULL, '8'},
+  {"pacing", no_argument, NULL, '9'},
+  {"record", required_argument, NULL, 'A'},
+  {"replayspeed", required_argument, NULL, 'B'},
+  {"vsync", required_argument, NULL, 'C'},
+  {"zerocopy", no_argument, NULL, 'D'},
+  {"audiolatency", required_argument, NULL, 'E'},
+  {"mouserate", required_argument, NULL, 'F'},
   {0, 0, 0, 0},
 };
 
@@ -260,6 +269,55 @@ static void parse_argument(int c, char* value, PCONFIGURATION config) {
   case '7':
     config->hdr = true;
     break;
+  case '8':
+    config->decode_queue = atoi(value);
+    if (config->decode_queue < 0 || config->decode_queue > DECODE_QUEUE_MAX) {
+      fprintf(stderr, "Decode queue depth must be between 0 and %d\n", DECODE_QUEUE_MAX);
+      exit(-1);
+    }
+    break;
+  case '9':
+    config->pacing = true;
+    break;
+  case 'A':
+    config->record_file = value;
+    break;
+  case 'B':
+    config->replay_speed = atof(value);
+    if (config->replay_speed < 0) {
+      fprintf(stderr, "Replay speed can't be negative\n");
+      exit(-1);
+    }
+    break;
+  case 'C':
+    if (strcasecmp(value, "off") == 0)
+      config->vsync = VSYNC_OFF;
+    else if (strcasecmp(value, "on") == 0)
+      config->vsync = VSYNC_ON;
+    else if (strcasecmp(value, "adaptive") == 0)
+      config->vsync = VSYNC_ADAPTIVE;
+    else {
+      fprintf(stderr, "Unknown vsync mode %s, use off, on or adaptive\n", value);
+      exit(-1);
+    }
+    break;
+  case 'D':
+    config->zero_copy = true;
+    break;
+  case 'E':
+    config->audio_latency = atoi(value);
+    if (config->audio_latency < 1 || config->audio_latency > 1000) {
+      fprintf(stderr, "Audio latency must be between 1 and 1000 ms\n");
+      exit(-1);
+    }
+    break;
+  case 'F':
+    config->mouse_rate = atoi(value);
+    if (config->mouse_rate < 0) {
+      fprintf(stderr, "Mouse rate can't be negative\n");
+      exit(-1);
+    }
+    break;
   case 1:
     if (config->action == NULL)
       config->action = value;
@@ -331,6 +389,22 @@ void config_save(char* filename, PCONFIGURATION config) {
     write_config_bool(fd, "viewonly", config->viewonly);
   if (config->rotate != 0)
     write_config_int(fd, "rotate", config->rotate);
+  if (config->decode_queue != 0)
+    write_config_int(fd, "decodequeue", config->decode_queue);
+  if (config->pacing)
+    write_config_bool(fd, "pacing", config->pacing);
+  if (config->vsync == VSYNC_OFF)
+    write_config_string(fd, "vsync", "off");
+  else if (config->vsync == VSYNC_ON)
+    write_config_string(fd, "vsync", "on");
+  else if (config->vsync == VSYNC_ADAPTIVE)
+    write_config_string(fd, "vsync", "adaptive");
+  if (config->zero_copy)
+    write_config_bool(fd, "zerocopy", config->zero_copy);
+  if (config->audio_latency != AUDIO_DEFAULT_LATENCY)
+    write_config_int(fd, "audiolatency", config->audio_latency);
+  if (config->mouse_rate != 0)
+    write_config_int(fd, "mouserate", config->mouse_rate);
 
   if (strcmp(config->app, "Steam") != 0)
     write_config_string(fd, "app", config->app);
@@ -380,6 +454,14 @@ void config_parse(int argc, char* argv[], PCONFIGURATION config) {
   config->rotate = 0;
   config->codec = CODEC_UNSPECIFIED;
   config->hdr = false;
+  config->decode_queue = 0;
+  config->pacing = false;
+  config->record_file = NULL;
+  config->replay_speed = 1;
+  config->vsync = VSYNC_DEFAULT;
+  config->zero_copy = false;
+  config->audio_latency = AUDIO_DEFAULT_LATENCY;
+  config->mouse_rate = 0;
   config->pin = 0;
   config->port = 47989;
 
@@ -399,7 +481,7 @@ void config_parse(int argc, char* argv[], PCONFIGURATION config) {
   } else {
     int option_index = 0;
     int c;
-    while ((c = getopt_long_only(argc, argv, "-abc:d:efg:h:i:j:k:lm:no:p:q:r:s:tu:v:w:xy45:6:7", long_options, &option_index)) != -1) {
+    while ((c = getopt_long_only(argc, argv, "-abc:d:efg:h:i:j:k:lm:no:p:q:r:s:tu:v:w:xy45:6:78:9A:B:C:DE:F:", long_options, &option_index)) != -1) {
       parse_argument(c, optarg, config);
     }
   }
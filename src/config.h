@@ -46,6 +46,14 @@ typedef struct _CONFIGURATION {
   int inputsCount;
   enum codecs codec;
   bool hdr;
+  int decode_queue;
+  bool pacing;
+  char* record_file;
+  double replay_speed;
+  int vsync;
+  bool zero_copy;
+  int audio_latency;
+  int mouse_rate;
   int pin;
   unsigned short port;
 } CONFIGURATION, *PCONFIGURATION;
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #ifdef HAVE_GETAUXVAL
 #include <sys/auxv.h>
@@ -29,6 +30,9 @@
 #ifndef HWCAP2_AES
 #define HWCAP2_AES (1 << 0)
 #endif
+#ifndef HWCAP_ARM_NEON
+#define HWCAP_ARM_NEON (1 << 12)
+#endif
 #endif
 
 #if defined(__linux__) && defined(__riscv)
@@ -118,4 +122,56 @@ bool has_slow_aes() {
 #endif
 
   return false;
-}
\ No newline at end of file
+}
+
+// Video decoders like dav1d only have fast paths for AVX2 and NEON
+bool has_fast_simd() {
+#if defined(__aarch64__)
+  return true;
+#elif defined(HAVE_GETAUXVAL) && defined(__arm__)
+  return !!(getauxval(AT_HWCAP) & HWCAP_ARM_NEON);
+#elif defined(HAVE_BICS_AVX2) && (defined(__x86_64__) || defined(__i386__))
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+int cpu_count(int* big_cores) {
+  int cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1)
+    cores = 1;
+
+  *big_cores = cores;
+
+  // On big.LITTLE systems the kernel reports the relative performance of
+  // each core, normalized to 1024 for the fastest core in the system
+  int configured = sysconf(_SC_NPROCESSORS_CONF);
+  int capacities[configured > 0 ? configured : 1];
+  int max_capacity = 0;
+  for (int i = 0; i < configured; i++) {
+    char path[64], value[16] = {};
+    capacities[i] = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/online", i);
+    if (read_file(path, value, sizeof(value) - 1) > 0 && value[0] == '0')
+      continue;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpu_capacity", i);
+    if (read_file(path, value, sizeof(value) - 1) > 0)
+      capacities[i] = atoi(value);
+
+    if (capacities[i] > max_capacity)
+      max_capacity = capacities[i];
+  }
+
+  if (max_capacity > 0) {
+    *big_cores = 0;
+    for (int i = 0; i < configured; i++) {
+      if (capacities[i] * 4 >= max_capacity * 3)
+        (*big_cores)++;
+    }
+  }
+
+  return cores;
+}
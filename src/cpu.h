@@ -19,3 +19,5 @@
 
 bool has_fast_aes(void);
 bool has_slow_aes(void);
+bool has_fast_simd(void);
+int cpu_count(int* big_cores);
@@ -0,0 +1,60 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2015 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mouse.h"
+
+#include <Limelight.h>
+
+#include <limits.h>
+
+int mouse_motion_rate;
+
+static int pending_x, pending_y;
+static uint64_t last_flush;
+
+// Motion from high rate mice is summed up, so the host gets one packet per flush instead of one per event
+void mouse_motion_add(int delta_x, int delta_y) {
+  pending_x += delta_x;
+  pending_y += delta_y;
+}
+
+static short mouse_motion_clamp(int delta) {
+  return delta > SHRT_MAX ? SHRT_MAX : (delta < SHRT_MIN ? SHRT_MIN : delta);
+}
+
+// Sends the pending motion, unless forced it is held back to respect the rate limit.
+// Returns the ms after which to flush again when motion is still pending, 0 otherwise.
+int mouse_motion_flush(bool force) {
+  if (pending_x == 0 && pending_y == 0)
+    return 0;
+
+  uint64_t now = LiGetMillis();
+  if (!force && mouse_motion_rate > 0 && now - last_flush < 1000 / mouse_motion_rate)
+    return 1000 / mouse_motion_rate - (now - last_flush);
+
+  // What doesn't fit in a single packet is kept for the next flush
+  short x = mouse_motion_clamp(pending_x);
+  short y = mouse_motion_clamp(pending_y);
+  LiSendMouseMoveEvent(x, y);
+  pending_x -= x;
+  pending_y -= y;
+  last_flush = now;
+
+  return pending_x != 0 || pending_y != 0 ? 1 : 0;
+}
@@ -18,6 +18,7 @@
  */
 
 #include "sdl.h"
+#include "mouse.h"
 #include "../sdl.h"
 
 #include <Limelight.h>
@@ -453,14 +454,17 @@ int sdlinput_handle_event(SDL_Window* window, SDL_Event* event) {
   switch (event->type) {
   case SDL_MOUSEMOTION:
     if (SDL_GetRelativeMouseMode())
-      LiSendMouseMoveEvent(event->motion.xrel, event->motion.yrel);
+      mouse_motion_add(event->motion.xrel, event->motion.yrel);
     else {
+      mouse_motion_flush(true);
       int w, h;
       SDL_GetWindowSize(window, &w, &h);
       LiSendMousePositionEvent(event->motion.x, event->motion.y, w, h);
     }
     break;
   case SDL_MOUSEWHEEL:
+    // Send held back motion first, so scrolling and clicks happen where the pointer is
+    mouse_motion_flush(true);
 #if SDL_VERSION_ATLEAST(2, 0, 18)
     LiSendHighResHScrollEvent((short)(event->wheel.preciseX * 120)); // WHEEL_DELTA
     LiSendHighResScrollEvent((short)(event->wheel.preciseY * 120)); // WHEEL_DELTA
@@ -471,6 +475,7 @@ int sdlinput_handle_event(SDL_Window* window, SDL_Event* event) {
     break;
   case SDL_MOUSEBUTTONUP:
   case SDL_MOUSEBUTTONDOWN:
+    mouse_motion_flush(true);
     switch (event->button.button) {
     case SDL_BUTTON_LEFT:
       button = BUTTON_LEFT;
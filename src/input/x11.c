@@ -19,6 +19,7 @@
 
 #include "x11.h"
 #include "keyboard.h"
+#include "mouse.h"
 
 #include "../loop.h"
 
@@ -29,7 +30,10 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <poll.h>
+#include <sys/timerfd.h>
 
 #define ACTION_MODIFIERS (MODIFIER_SHIFT|MODIFIER_ALT|MODIFIER_CTRL)
 #define QUIT_KEY 0x18  /* KEY_Q */
@@ -46,10 +50,33 @@ static const char data[1] = {0};
 static Cursor cursor;
 static bool grabbed = True;
 
+// Wakes up the loop to send mouse motion held back by the rate limit
+static int motion_timer_fd = -1;
+
+static void x11_flush_motion() {
+  int delay = mouse_motion_flush(false);
+  if (delay > 0) {
+    struct itimerspec timeout = {0};
+    timeout.it_value.tv_sec = delay / 1000;
+    timeout.it_value.tv_nsec = (delay % 1000) * 1000000;
+    if (timerfd_settime(motion_timer_fd, 0, &timeout, NULL) < 0)
+      mouse_motion_flush(true);
+  }
+}
+
+static int x11_motion_timer_handler(int fd) {
+  uint64_t expirations;
+  if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+    x11_flush_motion();
+
+  return LOOP_OK;
+}
+
 static int x11_handler(int fd) {
   XEvent event;
   int button = 0;
   int motion_x, motion_y;
+  bool moved = false;
 
   while (XPending(display)) {
     XNextEvent(display, &event);
@@ -95,6 +122,8 @@ static int x11_handler(int fd) {
       break;
     case ButtonPress:
     case ButtonRelease:
+      // Send held back motion first, so scrolling and clicks happen where the pointer is
+      mouse_motion_flush(true);
       switch (event.xbutton.button) {
       case Button1:
         button = BUTTON_LEFT;
@@ -133,14 +162,13 @@ static int x11_handler(int fd) {
       motion_y = event.xmotion.y - last_y;
       if (abs(motion_x) > 0 || abs(motion_y) > 0) {
         if (last_x >= 0 && last_y >= 0)
-          LiSendMouseMoveEvent(motion_x, motion_y);
+          mouse_motion_add(motion_x, motion_y);
 
-        if (grabbed)
-          XWarpPointer(display, None, window, 0, 0, 0, 0, 640, 360);
+        moved = true;
       }
 
-      last_x = grabbed ? 640 : event.xmotion.x;
-      last_y = grabbed ? 360 : event.xmotion.y;
+      last_x = event.xmotion.x;
+      last_y = event.xmotion.y;
       break;
     case ClientMessage:
       if (event.xclient.data.l[0] == wm_deletemessage)
@@ -150,6 +178,14 @@ static int x11_handler(int fd) {
     }
   }
 
+  // Warp the pointer back and send the motion once for all queued events
+  if (grabbed && moved) {
+    XWarpPointer(display, None, window, 0, 0, 0, 0, 640, 360);
+    last_x = 640;
+    last_y = 360;
+  }
+  x11_flush_motion();
+
   return LOOP_OK;
 }
 
@@ -168,4 +204,8 @@ void x11_input_init(Display* x11_display, Window x11_window) {
   XDefineCursor(display, window, cursor);
 
   loop_add_fd(ConnectionNumber(display), x11_handler, POLLIN | POLLERR | POLLHUP);
+
+  motion_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (motion_timer_fd >= 0)
+    loop_add_fd(motion_timer_fd, x11_motion_timer_handler, POLLIN);
 }
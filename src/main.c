@@ -22,12 +22,18 @@
 #include "configuration.h"
 #include "platform.h"
 #include "config.h"
+#include "record.h"
+#include "replay.h"
 #include "sdl.h"
 
 #include "audio/audio.h"
 #include "video/video.h"
+#if defined(HAVE_SDL) || defined(HAVE_X11)
+#include "video/ffmpeg.h"
+#endif
 
 #include "input/mapping.h"
+#include "input/mouse.h"
 #include "input/evdev.h"
 #include "input/udev.h"
 #ifdef HAVE_LIBCEC
@@ -83,6 +89,83 @@ static int get_app_id(PSERVER_DATA server, const char *name) {
   return -1;
 }
 
+static int video_flags(PCONFIGURATION config) {
+  int drFlags = 0;
+  if (config->fullscreen)
+    drFlags |= DISPLAY_FULLSCREEN;
+
+  switch (config->rotate) {
+  case 0:
+    break;
+  case 90:
+    drFlags |= DISPLAY_ROTATE_90;
+    break;
+  case 180:
+    drFlags |= DISPLAY_ROTATE_180;
+    break;
+  case 270:
+    drFlags |= DISPLAY_ROTATE_270;
+    break;
+  default:
+    printf("Ignoring invalid rotation value: %d\n", config->rotate);
+  }
+
+  drFlags |= (config->decode_queue << DECODE_QUEUE_SHIFT) & DECODE_QUEUE_MASK;
+  if (config->pacing)
+    drFlags |= FRAME_PACING;
+  drFlags |= (config->vsync << VSYNC_SHIFT) & VSYNC_MASK;
+  if (config->zero_copy)
+    drFlags |= DECODE_TO_TEXTURE;
+
+  return drFlags;
+}
+
+// Only the SDL audio renderer reads arFlags, as its target latency
+static int audio_flags(PAUDIO_RENDERER_CALLBACKS audio, PCONFIGURATION config) {
+  #ifdef HAVE_SDL
+  if (audio == &audio_callbacks_sdl)
+    return config->audio_latency & AUDIO_LATENCY_MASK;
+  #endif
+
+  return 0;
+}
+
+// Capabilities which depend on the stream are set on a copy of the platform callbacks
+static PDECODER_RENDERER_CALLBACKS stream_video_callbacks(enum platform system, PCONFIGURATION config) {
+  static DECODER_RENDERER_CALLBACKS callbacks;
+  PDECODER_RENDERER_CALLBACKS platform_callbacks = platform_get_video(system);
+  if (platform_callbacks == NULL)
+    return NULL;
+
+  callbacks = *platform_callbacks;
+
+  #if defined(HAVE_SDL) || defined(HAVE_X11)
+  // Ask for as many slices as the FFmpeg decoder will use slice threads
+  enum decoders decoder;
+  switch (system) {
+  case SDL:
+  case X11:
+  case FAKE:
+    decoder = SOFTWARE;
+    break;
+  case X11_VAAPI:
+    decoder = VAAPI;
+    break;
+  case X11_VDPAU:
+    decoder = VDPAU;
+    break;
+  default:
+    return &callbacks;
+  }
+
+  int slices = ffmpeg_slices_per_frame(config->stream.supportedVideoFormats, config->stream.width, config->stream.height, config->stream.fps, decoder);
+  callbacks.capabilities &= ~CAPABILITY_SLICES_PER_FRAME(0xFF);
+  callbacks.capabilities |= CAPABILITY_SLICES_PER_FRAME(slices);
+  #endif
+
+  return &callbacks;
+}
+
 static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform system) {
   int appId = get_app_id(server, config->app);
   if (appId<0) {
@@ -114,25 +197,7 @@ static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform sys
     exit(-1);
   }
 
-  int drFlags = 0;
-  if (config->fullscreen)
-    drFlags |= DISPLAY_FULLSCREEN;
-
-  switch (config->rotate) {
-  case 0:
-    break;
-  case 90:
-    drFlags |= DISPLAY_ROTATE_90;
-    break;
-  case 180:
-    drFlags |= DISPLAY_ROTATE_180;
-    break;
-  case 270:
-    drFlags |= DISPLAY_ROTATE_270;
-    break;
-  default:
-    printf("Ignoring invalid rotation value: %d\n", config->rotate);
-  }
+  int drFlags = video_flags(config);
 
   if (config->debug_level > 0) {
     printf("Stream %d x %d, %d fps, %d kbps\n", config->stream.width, config->stream.height, config->stream.fps, config->stream.bitrate);
@@ -142,8 +207,23 @@ static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform sys
   if (IS_EMBEDDED(system))
     loop_init();
 
+  PDECODER_RENDERER_CALLBACKS video_callbacks = stream_video_callbacks(system, config);
+  #if defined(HAVE_SDL) || defined(HAVE_X11)
+  mouse_motion_rate = config->mouse_rate;
+  #endif
+
+  PAUDIO_RENDERER_CALLBACKS audio_callbacks = platform_get_audio(system, config->audio_device);
+  int arFlags = audio_flags(audio_callbacks, config);
+  if (config->record_file != NULL) {
+    if (record_init(config->record_file) < 0)
+      exit(-1);
+
+    video_callbacks = record_video(video_callbacks);
+    audio_callbacks = record_audio(audio_callbacks);
+  }
+
   platform_start(system);
-  LiStartConnection(&server->serverInfo, &config->stream, &connection_callbacks, platform_get_video(system), platform_get_audio(system, config->audio_device), NULL, drFlags, config->audio_device, 0);
+  LiStartConnection(&server->serverInfo, &config->stream, &connection_callbacks, video_callbacks, audio_callbacks, config->key_dir, drFlags, config->audio_device, arFlags);
 
   if (IS_EMBEDDED(system)) {
     if (!config->viewonly)
@@ -158,6 +238,12 @@ static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform sys
   #endif
 
   LiStopConnection();
+  record_destroy();
+
+  #ifdef HAVE_SDL
+  if (system == SDL)
+    sdl_destroy();
+  #endif
 
   if (config->quitappafter) {
     if (config->debug_level > 0)
@@ -168,6 +254,52 @@ static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform sys
   platform_stop(system);
 }
 
+static void replay(PCONFIGURATION config) {
+  if (config->address == NULL) {
+    fprintf(stderr, "You need to specify a recording to replay\n");
+    exit(-1);
+  }
+
+  enum platform system = platform_check(config->platform);
+  if (system == 0) {
+    fprintf(stderr, "Platform '%s' not found\n", config->platform);
+    exit(-1);
+  }
+
+  // The recording provides the stream configuration
+  if (replay_open(config->address, &config->stream) < 0)
+    exit(-1);
+
+  #ifdef HAVE_SDL
+  if (system == SDL)
+    sdl_init(config->stream.width, config->stream.height, config->fullscreen, config->vsync);
+  #endif
+
+  if (IS_EMBEDDED(system))
+    loop_init();
+
+
+  PAUDIO_RENDERER_CALLBACKS audio_callbacks = platform_get_audio(system, config->audio_device);
+  platform_start(system);
+  if (replay_start(stream_video_callbacks(system, config), audio_callbacks, config->key_dir, video_flags(config), config->audio_device, audio_flags(audio_callbacks, config), config->replay_speed) == 0) {
+    if (IS_EMBEDDED(system))
+      loop_main();
+    #ifdef HAVE_SDL
+    else if (system == SDL)
+      sdl_loop();
+    #endif
+  }
+
+  replay_stop();
+
+  #ifdef HAVE_SDL
+  if (system == SDL)
+    sdl_destroy();
+  #endif
+
+  platform_stop(system);
+}
+
 static void help() {
   #ifdef GIT_BRANCH
   printf("Moonlight Embedded %d.%d.%d-%s-%s\n", VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH, GIT_BRANCH, GIT_COMMIT_HASH);
@@ -183,6 +315,7 @@ static void help() {
   printf("\tlist\t\t\tList available games and applications\n");
   printf("\tquit\t\t\tQuit the application or game being streamed\n");
   printf("\tmap\t\t\tCreate mapping for gamepad\n");
+  printf("\treplay <file>\t\tReplay a recorded session without a host\n");
   printf("\thelp\t\t\tShow this help\n");
   printf("\n Global Options\n\n");
   printf("\t-config <config>\tLoad configuration file\n");
@@ -215,9 +348,17 @@ static void help() {
   printf("\t-quitappafter\t\tSend quit app request to remote after quitting session\n");
   printf("\t-viewonly\t\tDisable all input processing (view-only mode)\n");
   printf("\t-nomouseemulation\t\tDisable gamepad mouse emulation support (long pressing Start button)\n");
+  printf("\t-record <file>\t\tRecord the received video and audio with their timing to <file>\n");
+  printf("\t-replayspeed <factor>\tReplay a recording at <factor> times the recorded speed, 0 for as fast as possible (default 1)\n");
   #if defined(HAVE_SDL) || defined(HAVE_X11)
   printf("\n WM options (SDL and X11 only)\n\n");
   printf("\t-windowed\t\tDisplay screen in a window\n");
+  printf("\t-decodequeue <depth>\tDecode on a separate thread with a queue of <depth> frames (default 0, decode directly)\n");
+  printf("\t-pacing\t\t\tPace frames from host timestamps to hide network jitter (adds latency)\n");
+  printf("\t-vsync <off/on/adaptive>\tSynchronize presenting to the display refresh (default driver default for X11, on for SDL)\n");
+  printf("\t-mouserate <hz>\t\tSend mouse motion at most <hz> times per second (default 0, once per event batch)\n");
+  printf("\t-zerocopy\t\tDecode directly into the textures which are drawn (SDL, not with OpenGL)\n");
+  printf("\t-audiolatency <ms>\tBuffer <ms> of audio to absorb network jitter (SDL only, default 20)\n");
   #endif
   #ifdef HAVE_EMBEDDED
   printf("\n I/O options (Not for SDL)\n\n");
@@ -254,6 +395,9 @@ int main(int argc, char* argv[]) {
     evdev_create(config.inputs[0], NULL, config.debug_level > 0, config.rotate);
     evdev_map(config.inputs[0]);
     exit(0);
+  } else if (strcmp("replay", config.action) == 0) {
+    replay(&config);
+    exit(0);
   }
 
   if (config.address == NULL) {
@@ -320,12 +464,12 @@ int main(int argc, char* argv[]) {
     }
 
     config.stream.supportedVideoFormats = VIDEO_FORMAT_H264;
-    if (config.codec == CODEC_HEVC || (config.codec == CODEC_UNSPECIFIED && platform_prefers_codec(system, CODEC_HEVC))) {
+    if (config.codec == CODEC_HEVC || (config.codec == CODEC_UNSPECIFIED && platform_prefers_codec(system, CODEC_HEVC, &config.stream))) {
       config.stream.supportedVideoFormats |= VIDEO_FORMAT_H265;
       if (config.hdr)
         config.stream.supportedVideoFormats |= VIDEO_FORMAT_H265_MAIN10;
     }
-    if (config.codec == CODEC_AV1 || (config.codec == CODEC_UNSPECIFIED && platform_prefers_codec(system, CODEC_AV1))) {
+    if (config.codec == CODEC_AV1 || (config.codec == CODEC_UNSPECIFIED && platform_prefers_codec(system, CODEC_AV1, &config.stream))) {
       config.stream.supportedVideoFormats |= VIDEO_FORMAT_AV1_MAIN8;
       if (config.hdr)
         config.stream.supportedVideoFormats |= VIDEO_FORMAT_AV1_MAIN10;
@@ -338,7 +482,7 @@ int main(int argc, char* argv[]) {
 
     #ifdef HAVE_SDL
     if (system == SDL)
-      sdl_init(config.stream.width, config.stream.height, config.fullscreen);
+      sdl_init(config.stream.width, config.stream.height, config.fullscreen, config.vsync);
     #endif
 
     if (config.viewonly) {
@@ -25,6 +25,9 @@
 
 #include "audio/audio.h"
 #include "video/video.h"
+#if defined(HAVE_SDL) || defined(HAVE_X11)
+#include "video/ffmpeg.h"
+#endif
 
 #include <stdlib.h>
 #include <string.h>
@@ -140,6 +143,10 @@ void platform_stop(enum platform system) {
 
 DECODER_RENDERER_CALLBACKS* platform_get_video(enum platform system) {
   switch (system) {
+  #if defined(HAVE_SDL) || defined(HAVE_X11)
+  case FAKE:
+    return &decoder_callbacks_fake;
+  #endif
   #ifdef HAVE_X11
   case X11:
     return &decoder_callbacks_x11;
@@ -183,7 +190,7 @@ DECODER_RENDERER_CALLBACKS* platform_get_video(enum platform system) {
 AUDIO_RENDERER_CALLBACKS* platform_get_audio(enum platform system, char* audio_device) {
   switch (system) {
   case FAKE:
-      return NULL;
+    return &audio_callbacks_fake;
   #ifdef HAVE_SDL
   case SDL:
     return &audio_callbacks_sdl;
@@ -209,7 +216,7 @@ AUDIO_RENDERER_CALLBACKS* platform_get_audio(enum platform system, char* audio_d
   return NULL;
 }
 
-bool platform_prefers_codec(enum platform system, enum codecs codec) {
+bool platform_prefers_codec(enum platform system, enum codecs codec, PSTREAM_CONFIGURATION stream) {
   switch (codec) {
   case CODEC_H264:
     // H.264 is always supported
@@ -224,6 +231,14 @@ bool platform_prefers_codec(enum platform system, enum codecs codec) {
     }
     return false;
   case CODEC_AV1:
+    switch (system) {
+    #if defined(HAVE_SDL) || defined(HAVE_X11)
+    case SDL:
+    case X11:
+      // Only worth it when decoding in software is fast enough
+      return ffmpeg_prefers_av1(stream->width, stream->height, stream->fps);
+    #endif
+    }
     return false;
   }
   return false;
@@ -250,7 +265,7 @@ char* platform_name(enum platform system) {
   case SDL:
     return "SDL2 (software decoding)";
   case FAKE:
-    return "Fake (no a/v output)";
+    return "Fake (decode without a/v output)";
   default:
     return "Unknown";
   }
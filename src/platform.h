@@ -32,7 +32,7 @@ enum codecs { CODEC_UNSPECIFIED, CODEC_H264, CODEC_HEVC, CODEC_AV1 };
 enum platform platform_check(char*);
 PDECODER_RENDERER_CALLBACKS platform_get_video(enum platform system);
 PAUDIO_RENDERER_CALLBACKS platform_get_audio(enum platform system, char* audio_device);
-bool platform_prefers_codec(enum platform system, enum codecs codec);
+bool platform_prefers_codec(enum platform system, enum codecs codec, PSTREAM_CONFIGURATION stream);
 char* platform_name(enum platform system);
 
 void platform_start(enum platform system);
@@ -0,0 +1,328 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2015 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "record.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Records are copied into this buffer and written by a separate thread,
+// so disk I/O never stalls the receive threads
+#define RECORD_BUFFER_SIZE (16*1024*1024)
+
+static int record_fd = -1;
+static pthread_t record_thread;
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t record_cond = PTHREAD_COND_INITIALIZER;
+static bool record_stop, record_failed;
+
+static uint8_t* buffer;
+static size_t buffer_head, buffer_tail, buffer_used;
+static unsigned int records_written, records_dropped;
+
+static PDECODER_RENDERER_CALLBACKS video_target;
+static PAUDIO_RENDERER_CALLBACKS audio_target;
+static DECODER_RENDERER_CALLBACKS video_callbacks;
+static AUDIO_RENDERER_CALLBACKS audio_callbacks;
+
+static void put_u16(uint8_t* data, uint16_t value) {
+  data[0] = value;
+  data[1] = value >> 8;
+}
+
+static void put_u32(uint8_t* data, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    data[i] = value >> (i * 8);
+}
+
+static void put_u64(uint8_t* data, uint64_t value) {
+  for (int i = 0; i < 8; i++)
+    data[i] = value >> (i * 8);
+}
+
+// Must hold the mutex
+static void buffer_write(const void* data, size_t length) {
+  size_t first = RECORD_BUFFER_SIZE - buffer_head;
+  if (first > length)
+    first = length;
+
+  memcpy(buffer + buffer_head, data, first);
+  memcpy(buffer, (const uint8_t*) data + first, length - first);
+  buffer_head = (buffer_head + length) % RECORD_BUFFER_SIZE;
+  buffer_used += length;
+}
+
+// Reserves room for a complete record, records are dropped rather than blocking
+static bool record_begin(int type, size_t length) {
+  pthread_mutex_lock(&record_mutex);
+  if (record_failed) {
+    pthread_mutex_unlock(&record_mutex);
+    return false;
+  }
+  if (RECORD_BUFFER_SIZE - buffer_used < RECORD_ENTRY_HEADER_SIZE + length) {
+    records_dropped++;
+    pthread_mutex_unlock(&record_mutex);
+    return false;
+  }
+
+  uint8_t header[RECORD_ENTRY_HEADER_SIZE];
+  header[0] = type;
+  put_u32(header + 1, length);
+  put_u64(header + 5, LiGetMillis());
+  buffer_write(header, sizeof(header));
+  return true;
+}
+
+static void record_end() {
+  records_written++;
+  pthread_cond_signal(&record_cond);
+  pthread_mutex_unlock(&record_mutex);
+}
+
+static void* record_thread_run(void* data) {
+  pthread_mutex_lock(&record_mutex);
+  while (true) {
+    while (buffer_used == 0 && !record_stop)
+      pthread_cond_wait(&record_cond, &record_mutex);
+
+    if (buffer_used == 0)
+      break;
+
+    // Write up to the end of the buffer, the producers keep filling the rest meanwhile
+    size_t length = buffer_used;
+    if (length > RECORD_BUFFER_SIZE - buffer_tail)
+      length = RECORD_BUFFER_SIZE - buffer_tail;
+
+    pthread_mutex_unlock(&record_mutex);
+    ssize_t written = write(record_fd, buffer + buffer_tail, length);
+    int error = errno;
+    pthread_mutex_lock(&record_mutex);
+
+    if (written < 0) {
+      if (error == EINTR || error == EAGAIN)
+        continue;
+
+      // Skipping bytes would misframe every following record, so the recording ends here
+      fprintf(stderr, "Recording failed - %s, the file is truncated\n", strerror(error));
+      close(record_fd);
+      record_failed = true;
+      buffer_used = 0;
+      break;
+    }
+    buffer_tail = (buffer_tail + written) % RECORD_BUFFER_SIZE;
+    buffer_used -= written;
+  }
+  pthread_mutex_unlock(&record_mutex);
+
+  return NULL;
+}
+
+static int record_video_setup(int videoFormat, int width, int height, int redrawRate, void* context, int drFlags) {
+  if (record_begin(RECORD_VIDEO_SETUP, 20)) {
+    uint8_t payload[20];
+    put_u32(payload, videoFormat);
+    put_u32(payload + 4, width);
+    put_u32(payload + 8, height);
+    put_u32(payload + 12, redrawRate);
+    put_u32(payload + 16, drFlags);
+    buffer_write(payload, sizeof(payload));
+    record_end();
+  }
+
+  return video_target && video_target->setup ? video_target->setup(videoFormat, width, height, redrawRate, context, drFlags) : 0;
+}
+
+static void record_video_start() {
+  if (video_target && video_target->start)
+    video_target->start();
+}
+
+static void record_video_stop() {
+  if (video_target && video_target->stop)
+    video_target->stop();
+}
+
+static void record_video_cleanup() {
+  if (video_target && video_target->cleanup)
+    video_target->cleanup();
+}
+
+static int record_submit_decode_unit(PDECODE_UNIT decodeUnit) {
+  int entries = 0;
+  size_t length = 25;
+  for (PLENTRY entry = decodeUnit->bufferList; entry != NULL; entry = entry->next) {
+    length += 5 + entry->length;
+    entries++;
+  }
+
+  if (record_begin(RECORD_VIDEO_FRAME, length)) {
+    uint8_t header[25];
+    put_u32(header, decodeUnit->frameNumber);
+    header[4] = decodeUnit->frameType;
+    header[5] = decodeUnit->hdrActive;
+    header[6] = decodeUnit->colorspace;
+    put_u64(header + 7, decodeUnit->receiveTimeMs);
+    put_u32(header + 15, decodeUnit->presentationTimeMs);
+    put_u16(header + 19, entries);
+    put_u32(header + 21, decodeUnit->fullLength);
+    buffer_write(header, sizeof(header));
+
+    for (PLENTRY entry = decodeUnit->bufferList; entry != NULL; entry = entry->next) {
+      uint8_t entry_header[5];
+      entry_header[0] = entry->bufferType;
+      put_u32(entry_header + 1, entry->length);
+      buffer_write(entry_header, sizeof(entry_header));
+      buffer_write(entry->data, entry->length);
+    }
+    record_end();
+  }
+
+  return video_target && video_target->submitDecodeUnit ? video_target->submitDecodeUnit(decodeUnit) : DR_OK;
+}
+
+static int record_audio_init(int audioConfiguration, const POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
+  if (record_begin(RECORD_AUDIO_INIT, 32)) {
+    uint8_t payload[32];
+    put_u32(payload, audioConfiguration);
+    put_u32(payload + 4, opusConfig->sampleRate);
+    put_u32(payload + 8, opusConfig->channelCount);
+    put_u32(payload + 12, opusConfig->streams);
+    put_u32(payload + 16, opusConfig->coupledStreams);
+    put_u32(payload + 20, opusConfig->samplesPerFrame);
+    memcpy(payload + 24, opusConfig->mapping, 8);
+    buffer_write(payload, sizeof(payload));
+    record_end();
+  }
+
+  return audio_target && audio_target->init ? audio_target->init(audioConfiguration, opusConfig, context, arFlags) : 0;
+}
+
+static void record_audio_start() {
+  if (audio_target && audio_target->start)
+    audio_target->start();
+}
+
+static void record_audio_stop() {
+  if (audio_target && audio_target->stop)
+    audio_target->stop();
+}
+
+static void record_audio_cleanup() {
+  if (audio_target && audio_target->cleanup)
+    audio_target->cleanup();
+}
+
+static void record_decode_and_play_sample(char* data, int length) {
+  if (record_begin(RECORD_AUDIO_SAMPLE, length)) {
+    buffer_write(data, length);
+    record_end();
+  }
+
+  if (audio_target && audio_target->decodeAndPlaySample)
+    audio_target->decodeAndPlaySample(data, length);
+}
+
+PDECODER_RENDERER_CALLBACKS record_video(PDECODER_RENDERER_CALLBACKS callbacks) {
+  video_target = callbacks;
+  video_callbacks.setup = record_video_setup;
+  video_callbacks.start = record_video_start;
+  video_callbacks.stop = record_video_stop;
+  video_callbacks.cleanup = record_video_cleanup;
+  video_callbacks.submitDecodeUnit = record_submit_decode_unit;
+  video_callbacks.capabilities = callbacks ? callbacks->capabilities : CAPABILITY_DIRECT_SUBMIT;
+  return &video_callbacks;
+}
+
+PAUDIO_RENDERER_CALLBACKS record_audio(PAUDIO_RENDERER_CALLBACKS callbacks) {
+  audio_target = callbacks;
+  audio_callbacks.init = record_audio_init;
+  audio_callbacks.start = record_audio_start;
+  audio_callbacks.stop = record_audio_stop;
+  audio_callbacks.cleanup = record_audio_cleanup;
+  audio_callbacks.decodeAndPlaySample = record_decode_and_play_sample;
+  audio_callbacks.capabilities = callbacks ? callbacks->capabilities : CAPABILITY_DIRECT_SUBMIT;
+  return &audio_callbacks;
+}
+
+int record_init(const char* path) {
+  record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (record_fd < 0) {
+    fprintf(stderr, "Can't open recording file %s\n", path);
+    return -1;
+  }
+
+  uint8_t header[RECORD_HEADER_SIZE];
+  memcpy(header, RECORD_MAGIC, 4);
+  put_u32(header + 4, RECORD_VERSION);
+  if (write(record_fd, header, sizeof(header)) != sizeof(header)) {
+    fprintf(stderr, "Can't write recording file %s\n", path);
+    close(record_fd);
+    return -1;
+  }
+
+  buffer = malloc(RECORD_BUFFER_SIZE);
+  if (buffer == NULL) {
+    fprintf(stderr, "Not enough memory\n");
+    close(record_fd);
+    return -1;
+  }
+  // Touch every page now, so recording doesn't page fault on the receive threads
+  memset(buffer, 0, RECORD_BUFFER_SIZE);
+  buffer_head = buffer_tail = buffer_used = 0;
+  records_written = records_dropped = 0;
+  record_stop = record_failed = false;
+
+  if (pthread_create(&record_thread, NULL, record_thread_run, NULL) != 0) {
+    fprintf(stderr, "Couldn't start recording thread\n");
+    free(buffer);
+    close(record_fd);
+    return -1;
+  }
+
+  return 0;
+}
+
+void record_destroy() {
+  if (record_fd < 0)
+    return;
+
+  // The thread flushes everything left in the buffer before it exits
+  pthread_mutex_lock(&record_mutex);
+  record_stop = true;
+  pthread_cond_signal(&record_cond);
+  pthread_mutex_unlock(&record_mutex);
+  pthread_join(record_thread, NULL);
+
+  if (!record_failed)
+    close(record_fd);
+  record_fd = -1;
+  free(buffer);
+  buffer = NULL;
+
+  printf("Recorded %u entries", records_written);
+  if (records_dropped > 0)
+    printf(", dropped %u because the disk couldn't keep up", records_dropped);
+  printf("\n");
+}
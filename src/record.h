@@ -0,0 +1,48 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2015 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Limelight.h>
+
+#include <stdint.h>
+
+// Session capture file, all values are little endian:
+//   header: RECORD_MAGIC, u32 RECORD_VERSION
+//   record: u8 type, u32 payload length, u64 LiGetMillis() when received, payload
+#define RECORD_MAGIC "MLRC"
+#define RECORD_VERSION 1
+
+#define RECORD_HEADER_SIZE 8
+#define RECORD_ENTRY_HEADER_SIZE 13
+
+// i32 videoFormat, width, height, redrawRate, drFlags
+#define RECORD_VIDEO_SETUP 1
+// i32 audioConfiguration, sampleRate, channelCount, streams, coupledStreams, samplesPerFrame, u8 mapping[8]
+#define RECORD_AUDIO_INIT 2
+// i32 frameNumber, u8 frameType, u8 hdrActive, u8 colorspace, u64 receiveTimeMs, u32 presentationTimeMs,
+// u16 entry count, u32 fullLength, entries of u8 bufferType, u32 length, data
+#define RECORD_VIDEO_FRAME 3
+// Opus packet
+#define RECORD_AUDIO_SAMPLE 4
+
+int record_init(const char* path);
+void record_destroy(void);
+
+// Wrap renderer callbacks to record everything passed to them, callbacks may be NULL
+PDECODER_RENDERER_CALLBACKS record_video(PDECODER_RENDERER_CALLBACKS callbacks);
+PAUDIO_RENDERER_CALLBACKS record_audio(PAUDIO_RENDERER_CALLBACKS callbacks);
@@ -0,0 +1,374 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2015 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "replay.h"
+#include "record.h"
+#include "connection.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_SDL
+#include <SDL.h>
+#endif
+
+#define MAX_ENTRIES 256
+
+struct record {
+  int type;
+  uint64_t time;
+  uint8_t* payload;
+  uint32_t length;
+};
+
+static uint8_t* data;
+static size_t data_size;
+static struct record* records;
+static int records_count;
+
+static int video_setup[5];
+static int audio_configuration;
+static OPUS_MULTISTREAM_CONFIGURATION opus_config;
+static bool has_video_setup, has_audio_init;
+
+static PDECODER_RENDERER_CALLBACKS video_callbacks;
+static PAUDIO_RENDERER_CALLBACKS audio_callbacks;
+static double replay_speed;
+static struct timespec replay_start_time;
+static uint64_t first_time;
+
+static pthread_t video_thread, audio_thread;
+static bool video_started, audio_started;
+static bool stopping;
+static int threads_running;
+
+static unsigned int frames_submitted, frames_dropped, corrupt_frames, idr_requests, samples_played;
+static uint64_t max_lateness;
+
+static uint16_t get_u16(const uint8_t* data) {
+  return data[0] | data[1] << 8;
+}
+
+static uint32_t get_u32(const uint8_t* data) {
+  return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+static uint64_t get_u64(const uint8_t* data) {
+  return get_u32(data) | (uint64_t) get_u32(data + 4) << 32;
+}
+
+int replay_open(const char* path, PSTREAM_CONFIGURATION stream) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Can't open recording %s\n", path);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < RECORD_HEADER_SIZE) {
+    fprintf(stderr, "Can't read recording %s\n", path);
+    close(fd);
+    return -1;
+  }
+
+  // Map privately, as the buffers handed to the renderers aren't const
+  data_size = st.st_size;
+  data = mmap(NULL, data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    data = NULL;
+    fprintf(stderr, "Can't map recording %s\n", path);
+    return -1;
+  }
+
+  if (memcmp(data, RECORD_MAGIC, 4) != 0 || get_u32(data + 4) != RECORD_VERSION) {
+    fprintf(stderr, "%s isn't a supported recording\n", path);
+    return -1;
+  }
+
+  int records_size = 0;
+  size_t offset = RECORD_HEADER_SIZE;
+  while (offset + RECORD_ENTRY_HEADER_SIZE <= data_size) {
+    struct record record = {
+      .type = data[offset],
+      .length = get_u32(data + offset + 1),
+      .time = get_u64(data + offset + 5),
+      .payload = data + offset + RECORD_ENTRY_HEADER_SIZE,
+    };
+
+    // A recording which was cut off ends at the last complete record
+    offset += RECORD_ENTRY_HEADER_SIZE + record.length;
+    if (offset > data_size)
+      break;
+
+    if (record.type == RECORD_VIDEO_SETUP && record.length >= 20 && !has_video_setup) {
+      for (int i = 0; i < 5; i++)
+        video_setup[i] = get_u32(record.payload + i * 4);
+      has_video_setup = true;
+    } else if (record.type == RECORD_AUDIO_INIT && record.length >= 32 && !has_audio_init) {
+      audio_configuration = get_u32(record.payload);
+      opus_config.sampleRate = get_u32(record.payload + 4);
+      opus_config.channelCount = get_u32(record.payload + 8);
+      opus_config.streams = get_u32(record.payload + 12);
+      opus_config.coupledStreams = get_u32(record.payload + 16);
+      opus_config.samplesPerFrame = get_u32(record.payload + 20);
+      memcpy(opus_config.mapping, record.payload + 24, sizeof(opus_config.mapping));
+      has_audio_init = true;
+    } else if (record.type == RECORD_VIDEO_FRAME || record.type == RECORD_AUDIO_SAMPLE) {
+      if (records_count == records_size) {
+        records_size = records_size > 0 ? records_size * 2 : 4096;
+        records = realloc(records, records_size * sizeof(struct record));
+        if (records == NULL) {
+          fprintf(stderr, "Not enough memory\n");
+          return -1;
+        }
+      }
+      records[records_count++] = record;
+    }
+  }
+
+  if (!has_video_setup || records_count == 0) {
+    fprintf(stderr, "No video found in recording %s\n", path);
+    return -1;
+  }
+
+  first_time = records[0].time;
+  stream->width = video_setup[1];
+  stream->height = video_setup[2];
+  stream->fps = video_setup[3];
+  if (has_audio_init)
+    stream->audioConfiguration = audio_configuration;
+
+  printf("Replaying %.1f seconds of %dx%d video at %d fps\n", (records[records_count - 1].time - first_time) / 1000.0, stream->width, stream->height, stream->fps);
+  return 0;
+}
+
+// Sleeps until the record is due, returns how late it is in ms
+static uint64_t replay_wait(struct record* record) {
+  if (replay_speed <= 0)
+    return 0;
+
+  uint64_t offset_ns = (uint64_t) ((record->time - first_time) * 1000000 / replay_speed);
+  struct timespec due = replay_start_time;
+  due.tv_sec += offset_ns / 1000000000;
+  due.tv_nsec += offset_ns % 1000000000;
+  if (due.tv_nsec >= 1000000000) {
+    due.tv_nsec -= 1000000000;
+    due.tv_sec++;
+  }
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t late = (now.tv_sec - due.tv_sec) * 1000 + (now.tv_nsec - due.tv_nsec) / 1000000;
+  return late > 0 ? late : 0;
+}
+
+static void replay_finished() {
+  if (__atomic_sub_fetch(&threads_running, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  // Let the main loop return like at the end of a session
+  #ifdef HAVE_SDL
+  SDL_Event event;
+  event.type = SDL_QUIT;
+  SDL_PushEvent(&event);
+  #endif
+  if (main_thread_id != 0)
+    pthread_kill(main_thread_id, SIGTERM);
+}
+
+// Links the buffers of a video frame record, fails if they don't match the payload
+static bool replay_parse_entries(struct record* record, LENTRY* entries, PDECODE_UNIT decodeUnit) {
+  int count = get_u16(record->payload + 19);
+  if (count > MAX_ENTRIES)
+    return false;
+
+  size_t offset = 25;
+  uint64_t total = 0;
+  for (int j = 0; j < count; j++) {
+    if (offset + 5 > record->length)
+      return false;
+
+    uint32_t length = get_u32(record->payload + offset + 1);
+    if (length > record->length - offset - 5)
+      return false;
+
+    entries[j].bufferType = record->payload[offset];
+    entries[j].length = length;
+    entries[j].data = (char*) record->payload + offset + 5;
+    entries[j].next = NULL;
+
+    if (j > 0)
+      entries[j - 1].next = &entries[j];
+    offset += 5 + entries[j].length;
+    total += entries[j].length;
+  }
+
+  if (total != (uint64_t) decodeUnit->fullLength)
+    return false;
+
+  decodeUnit->bufferList = count > 0 ? entries : NULL;
+  return true;
+}
+
+static void* replay_video(void* arg) {
+  static LENTRY entries[MAX_ENTRIES];
+  bool waiting_for_idr = false;
+  unsigned int first_pts = 0;
+
+  for (int i = 0; i < records_count && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE); i++) {
+    struct record* record = &records[i];
+    if (record->type != RECORD_VIDEO_FRAME || record->length < 25)
+      continue;
+
+    uint64_t late = replay_wait(record);
+    if (late > max_lateness)
+      max_lateness = late;
+
+    DECODE_UNIT decodeUnit = {0};
+    decodeUnit.frameNumber = get_u32(record->payload);
+    decodeUnit.frameType = record->payload[4];
+    decodeUnit.hdrActive = record->payload[5];
+    decodeUnit.colorspace = record->payload[6];
+    decodeUnit.presentationTimeMs = get_u32(record->payload + 15);
+    decodeUnit.fullLength = get_u32(record->payload + 21);
+    decodeUnit.receiveTimeMs = decodeUnit.enqueueTimeMs = LiGetMillis();
+
+    // Like moonlight-common-c, drop everything until the IDR frame a renderer asked for
+    if (waiting_for_idr && decodeUnit.frameType != FRAME_TYPE_IDR) {
+      frames_dropped++;
+      continue;
+    }
+    waiting_for_idr = false;
+
+    // Host timestamps have to advance at the replay speed for frame pacing
+    if (first_pts == 0)
+      first_pts = decodeUnit.presentationTimeMs;
+    if (replay_speed > 0)
+      decodeUnit.presentationTimeMs = first_pts + (decodeUnit.presentationTimeMs - first_pts) / replay_speed;
+
+    // A corrupt frame is dropped like a frame lost on the network
+    if (!replay_parse_entries(record, entries, &decodeUnit)) {
+      corrupt_frames++;
+      waiting_for_idr = true;
+      continue;
+    }
+
+    frames_submitted++;
+    if (video_callbacks->submitDecodeUnit(&decodeUnit) == DR_NEED_IDR) {
+      idr_requests++;
+      waiting_for_idr = true;
+    }
+  }
+
+  replay_finished();
+  return NULL;
+}
+
+static void* replay_audio(void* arg) {
+  for (int i = 0; i < records_count && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE); i++) {
+    struct record* record = &records[i];
+    if (record->type != RECORD_AUDIO_SAMPLE)
+      continue;
+
+    replay_wait(record);
+    audio_callbacks->decodeAndPlaySample((char*) record->payload, record->length);
+    samples_played++;
+  }
+
+  replay_finished();
+  return NULL;
+}
+
+int replay_start(PDECODER_RENDERER_CALLBACKS video, PAUDIO_RENDERER_CALLBACKS audio, void* renderContext, int drFlags, void* audioContext, int arFlags, double speed) {
+  video_callbacks = video;
+  audio_callbacks = has_audio_init ? audio : NULL;
+  replay_speed = speed;
+  stopping = false;
+
+  if (video_callbacks == NULL) {
+    fprintf(stderr, "Platform has no video renderer to replay to\n");
+    return -1;
+  }
+
+  if (video_callbacks->setup && video_callbacks->setup(video_setup[0], video_setup[1], video_setup[2], video_setup[3], renderContext, drFlags) < 0) {
+    fprintf(stderr, "Couldn't set up video renderer\n");
+    return -1;
+  }
+  if (audio_callbacks && audio_callbacks->init && audio_callbacks->init(audio_configuration, &opus_config, audioContext, arFlags) < 0) {
+    fprintf(stderr, "Couldn't initialize audio renderer, replaying without audio\n");
+    audio_callbacks = NULL;
+  }
+
+  if (video_callbacks->start)
+    video_callbacks->start();
+  if (audio_callbacks && audio_callbacks->start)
+    audio_callbacks->start();
+
+  threads_running = audio_callbacks ? 2 : 1;
+  clock_gettime(CLOCK_MONOTONIC, &replay_start_time);
+  video_started = pthread_create(&video_thread, NULL, replay_video, NULL) == 0;
+  if (audio_callbacks)
+    audio_started = pthread_create(&audio_thread, NULL, replay_audio, NULL) == 0;
+
+  return 0;
+}
+
+void replay_stop() {
+  __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+  if (video_started)
+    pthread_join(video_thread, NULL);
+  if (audio_started)
+    pthread_join(audio_thread, NULL);
+
+  if (audio_callbacks) {
+    if (audio_callbacks->stop)
+      audio_callbacks->stop();
+    if (audio_callbacks->cleanup)
+      audio_callbacks->cleanup();
+  }
+  if (video_callbacks) {
+    if (video_callbacks->stop)
+      video_callbacks->stop();
+    if (video_callbacks->cleanup)
+      video_callbacks->cleanup();
+  }
+
+  printf("Replayed %u video frames and %u audio packets, submitted up to %llu ms late\n", frames_submitted, samples_played, (unsigned long long) max_lateness);
+  if (idr_requests > 0 || frames_dropped > 0)
+    printf("%u IDR frames requested, %u frames dropped waiting for them\n", idr_requests, frames_dropped);
+  if (corrupt_frames > 0)
+    printf("%u corrupt frames dropped\n", corrupt_frames);
+
+  free(records);
+  records = NULL;
+  if (data != NULL)
+    munmap(data, data_size);
+  data = NULL;
+}
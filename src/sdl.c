@@ -21,8 +21,17 @@
 
 #include "sdl.h"
 #include "input/sdl.h"
+#include "input/mouse.h"
+#include "video/video.h"
+#include "video/pacer.h"
 
 #include <Limelight.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
 
 static bool done;
 static int fullscreen_flags;
@@ -31,13 +40,42 @@ static SDL_Window *window;
 static SDL_Renderer *renderer;
 static SDL_Texture *bmp;
 
-SDL_mutex *mutex;
+// The texture follows the pixel format of the decoded frames, so they are uploaded without conversion
+static Uint32 bmp_format;
+static int bmp_width, bmp_height;
+static int unsupported_format = -1;
+
+// Only the newest frame is kept, the render loop is woken up when the slot was empty
+static AVFrame* mailbox;
+static unsigned int frames_replaced;
+
+// Streaming textures the decoder writes into while they are locked, so drawing them only needs the unlock.
+// A texture can't be touched once it's unlocked, so only frames the decoder won't reference later use them.
+#define TEXTURE_POOL_SIZE 8
+
+// These renderers lock a copy SDL keeps in memory and upload it on unlock, like an update would do
+static const char* texture_staging_renderers[] = {"opengl", "opengles2", "opengles", "software"};
+
+enum texture_state {TEXTURE_UNUSED, TEXTURE_FREE, TEXTURE_DECODING, TEXTURE_SHOWN, TEXTURE_RELEASED};
+
+struct texture_buffer {
+  SDL_Texture* texture;
+  enum texture_state state;
+  Uint8* pixels;
+  int pitch;
+};
 
-int sdlCurrentFrame, sdlNextFrame;
+static struct texture_buffer texture_pool[TEXTURE_POOL_SIZE];
+static int texture_width, texture_height;
+static SDL_mutex* texture_mutex;
+static unsigned int texture_buffers, texture_fallbacks;
 
-void sdl_init(int width, int height, bool fullscreen) {
-  sdlCurrentFrame = sdlNextFrame = 0;
+static Uint64 last_present;
+static bool present_vsync;
+static unsigned int presents;
+static double present_sum, present_square_sum, present_max;
 
+void sdl_init(int width, int height, bool fullscreen, int vsync) {
   if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS)) {
     fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
     exit(1);
@@ -50,31 +88,316 @@ void sdl_init(int width, int height, bool fullscreen) {
     exit(1);
   }
 
-  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+  Uint32 renderer_flags = SDL_RENDERER_ACCELERATED;
+  if (vsync != VSYNC_OFF)
+    renderer_flags |= SDL_RENDERER_PRESENTVSYNC;
+
+  renderer = SDL_CreateRenderer(window, -1, renderer_flags);
   if (!renderer) {
     printf("SDL_CreateRenderer failed: %s\n", SDL_GetError());
     exit(1);
   }
 
-  bmp = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12, SDL_TEXTUREACCESS_STREAMING, width, height);
+  SDL_RendererInfo info;
+  // The driver may ignore the request, so presents only stand in for refreshes when vsync was asked for
+  present_vsync = (vsync == VSYNC_ON || vsync == VSYNC_ADAPTIVE) && SDL_GetRendererInfo(renderer, &info) == 0 &&
+                  (info.flags & SDL_RENDERER_PRESENTVSYNC);
+
+  // Late frames are presented immediately, only the OpenGL renderers support this
+  if (vsync == VSYNC_ADAPTIVE && SDL_GL_SetSwapInterval(-1) < 0)
+    fprintf(stderr, "SDL: adaptive vsync isn't supported, using vsync\n");
+
+  bmp_format = SDL_PIXELFORMAT_YV12;
+  bmp_width = width;
+  bmp_height = height;
+  bmp = SDL_CreateTexture(renderer, bmp_format, SDL_TEXTUREACCESS_STREAMING, width, height);
   if (!bmp) {
     fprintf(stderr, "SDL: could not create texture - exiting\n");
     exit(1);
   }
+  unsupported_format = -1;
 
-  mutex = SDL_CreateMutex();
-  if (!mutex) {
-    fprintf(stderr, "Couldn't create mutex\n");
-    exit(1);
+  frames_replaced = 0;
+  last_present = 0;
+  presents = 0;
+  present_sum = present_square_sum = present_max = 0;
+}
+
+// Only one thread queues frames at a time, the decoder or the pacer
+void sdl_queue_frame(AVFrame* frame) {
+  if (frame == NULL)
+    return;
+
+  AVFrame* copy = av_frame_clone(frame);
+  if (copy == NULL)
+    return;
+
+  AVFrame* replaced = __atomic_exchange_n(&mailbox, copy, __ATOMIC_ACQ_REL);
+  if (replaced != NULL) {
+    av_frame_free(&replaced);
+    frames_replaced++;
+  } else {
+    SDL_Event event;
+    event.type = SDL_USEREVENT;
+    event.user.code = SDL_CODE_FRAME;
+    SDL_PushEvent(&event);
+  }
+}
+
+// SDL2 has no texture formats for 10-bit YUV, those frames can't be drawn
+static Uint32 sdl_texture_format(int format) {
+  switch (format) {
+  case AV_PIX_FMT_YUV420P:
+  case AV_PIX_FMT_YUVJ420P:
+    return SDL_PIXELFORMAT_YV12;
+  #if SDL_VERSION_ATLEAST(2, 0, 16)
+  case AV_PIX_FMT_NV12:
+    return SDL_PIXELFORMAT_NV12;
+  case AV_PIX_FMT_NV21:
+    return SDL_PIXELFORMAT_NV21;
+  #endif
+  default:
+    return SDL_PIXELFORMAT_UNKNOWN;
+  }
+}
+
+static bool sdl_update_texture(AVFrame* frame) {
+  if (frame->format == unsupported_format)
+    return false;
+
+  Uint32 format = sdl_texture_format(frame->format);
+  if (format != bmp_format || frame->width != bmp_width || frame->height != bmp_height) {
+    SDL_Texture* texture = format == SDL_PIXELFORMAT_UNKNOWN ? NULL : SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_STREAMING, frame->width, frame->height);
+    if (!texture) {
+      fprintf(stderr, "SDL: unsupported pixel format %s\n", av_get_pix_fmt_name(frame->format));
+      unsupported_format = frame->format;
+      return false;
+    }
+
+    SDL_DestroyTexture(bmp);
+    bmp = texture;
+    bmp_format = format;
+    bmp_width = frame->width;
+    bmp_height = frame->height;
+  }
+
+  #if SDL_VERSION_ATLEAST(2, 0, 16)
+  if (bmp_format == SDL_PIXELFORMAT_NV12 || bmp_format == SDL_PIXELFORMAT_NV21)
+    return SDL_UpdateNVTexture(bmp, NULL, frame->data[0], frame->linesize[0], frame->data[1], frame->linesize[1]) == 0;
+  #endif
+
+  return SDL_UpdateYUVTexture(bmp, NULL, frame->data[0], frame->linesize[0], frame->data[1], frame->linesize[1], frame->data[2], frame->linesize[2]) == 0;
+}
+
+// Must be called from the thread running sdl_loop, textures are only locked and unlocked there
+int sdl_texture_pool_init(int width, int height) {
+  SDL_RendererInfo info;
+  if (SDL_GetRendererInfo(renderer, &info) < 0) {
+    fprintf(stderr, "SDL: could not get renderer info - %s\n", SDL_GetError());
+    return -1;
+  }
+  for (size_t i = 0; i < sizeof(texture_staging_renderers) / sizeof(texture_staging_renderers[0]); i++) {
+    if (strcmp(info.name, texture_staging_renderers[i]) == 0) {
+      fprintf(stderr, "SDL: decoding into textures saves no copy with the %s renderer\n", info.name);
+      return -1;
+    }
+  }
+
+  // Leave room for the alignment and extra rows libavcodec asks for, drawing crops to the frame
+  texture_width = FFALIGN(width, 128);
+  texture_height = FFALIGN(height, 64) + 16;
+  texture_buffers = texture_fallbacks = 0;
+
+  texture_mutex = SDL_CreateMutex();
+  if (!texture_mutex) {
+    fprintf(stderr, "SDL: could not create mutex - %s\n", SDL_GetError());
+    return -1;
+  }
+
+  for (int i = 0; i < TEXTURE_POOL_SIZE; i++) {
+    struct texture_buffer* buffer = &texture_pool[i];
+    buffer->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_IYUV, SDL_TEXTUREACCESS_STREAMING, texture_width, texture_height);
+    if (!buffer->texture || SDL_LockTexture(buffer->texture, NULL, (void**) &buffer->pixels, &buffer->pitch) < 0) {
+      fprintf(stderr, "SDL: could not create texture to decode into - %s\n", SDL_GetError());
+      sdl_texture_pool_destroy();
+      return -1;
+    }
+    buffer->state = TEXTURE_FREE;
+  }
+
+  return 0;
+}
+
+// Frames still waiting in the mailbox reference the textures, the decoder must be destroyed first
+void sdl_texture_pool_destroy() {
+  AVFrame* frame = __atomic_exchange_n(&mailbox, NULL, __ATOMIC_ACQ_REL);
+  av_frame_free(&frame);
+
+  for (int i = 0; i < TEXTURE_POOL_SIZE; i++) {
+    if (texture_pool[i].texture)
+      SDL_DestroyTexture(texture_pool[i].texture);
+  }
+  memset(texture_pool, 0, sizeof(texture_pool));
+
+  SDL_DestroyMutex(texture_mutex);
+  texture_mutex = NULL;
+
+  if (texture_buffers + texture_fallbacks > 0)
+    printf("SDL: %u of %u frames decoded directly into textures\n", texture_buffers, texture_buffers + texture_fallbacks);
+}
+
+static void sdl_texture_released(void* opaque, uint8_t* data) {
+  struct texture_buffer* buffer = opaque;
+
+  // Textures which were never drawn are still locked and can be handed out again right away
+  SDL_LockMutex(texture_mutex);
+  buffer->state = buffer->state == TEXTURE_SHOWN ? TEXTURE_RELEASED : TEXTURE_FREE;
+  SDL_UnlockMutex(texture_mutex);
+}
+
+// Called by libavcodec from its decoding threads, falls back to its own buffers when no texture fits
+int sdl_get_texture_buffer(AVCodecContext* ctx, AVFrame* frame, int flags) {
+  int width = frame->width;
+  int height = frame->height;
+  int linesize_align[AV_NUM_DATA_POINTERS];
+  avcodec_align_dimensions2(ctx, &width, &height, linesize_align);
+
+  struct texture_buffer* buffer = NULL;
+  bool reference = flags & AV_GET_BUFFER_FLAG_REF;
+  if (!reference && (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P) && width <= texture_width && height + 2 <= texture_height) {
+    SDL_LockMutex(texture_mutex);
+    for (int i = 0; i < TEXTURE_POOL_SIZE && buffer == NULL; i++) {
+      if (texture_pool[i].state == TEXTURE_FREE) {
+        buffer = &texture_pool[i];
+        buffer->state = TEXTURE_DECODING;
+      }
+    }
+    SDL_UnlockMutex(texture_mutex);
+  }
+
+  if (buffer != NULL) {
+    // The locked pixels hold the planes of the whole texture one after another
+    int chroma_pitch = (buffer->pitch + 1) / 2;
+    uint8_t* planes[3];
+    int linesizes[3] = {buffer->pitch, chroma_pitch, chroma_pitch};
+    planes[0] = buffer->pixels;
+    planes[1] = planes[0] + buffer->pitch * texture_height;
+    planes[2] = planes[1] + chroma_pitch * ((texture_height + 1) / 2);
+
+    bool aligned = buffer->pitch >= width;
+    for (int i = 0; i < 3; i++) {
+      if (linesizes[i] % linesize_align[i] != 0 || (uintptr_t) planes[i] % linesize_align[i] != 0)
+        aligned = false;
+    }
+
+    if (aligned)
+      frame->buf[0] = av_buffer_create(buffer->pixels, planes[2] + chroma_pitch * ((texture_height + 1) / 2) - planes[0], sdl_texture_released, buffer, 0);
+
+    if (frame->buf[0] != NULL) {
+      for (int i = 0; i < 3; i++) {
+        frame->data[i] = planes[i];
+        frame->linesize[i] = linesizes[i];
+      }
+      frame->extended_data = frame->data;
+      __atomic_fetch_add(&texture_buffers, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+
+    SDL_LockMutex(texture_mutex);
+    buffer->state = TEXTURE_FREE;
+    SDL_UnlockMutex(texture_mutex);
+  }
+
+  __atomic_fetch_add(&texture_fallbacks, 1, __ATOMIC_RELAXED);
+  return avcodec_default_get_buffer2(ctx, frame, flags);
+}
+
+// Uploads a frame decoded into a texture and returns that texture, NULL for other frames
+static SDL_Texture* sdl_texture_pool_show(AVFrame* frame, SDL_Rect* rect) {
+  if (frame->buf[0] == NULL)
+    return NULL;
+
+  struct texture_buffer* buffer = NULL;
+  bool upload = false;
+  void* opaque = av_buffer_get_opaque(frame->buf[0]);
+
+  // The frame holds a reference, so the decoder can't release the texture meanwhile
+  SDL_LockMutex(texture_mutex);
+  for (int i = 0; i < TEXTURE_POOL_SIZE; i++) {
+    if (opaque == &texture_pool[i] && texture_pool[i].state != TEXTURE_UNUSED)
+      buffer = &texture_pool[i];
+  }
+  if (buffer != NULL && buffer->state == TEXTURE_DECODING) {
+    buffer->state = TEXTURE_SHOWN;
+    upload = true;
+  }
+  SDL_UnlockMutex(texture_mutex);
+
+  if (buffer == NULL)
+    return NULL;
+
+  if (upload)
+    SDL_UnlockTexture(buffer->texture);
+
+  // Cropping moves the data pointers into the texture
+  ptrdiff_t offset = frame->data[0] - buffer->pixels;
+  rect->x = offset % buffer->pitch;
+  rect->y = offset / buffer->pitch;
+  rect->w = frame->width;
+  rect->h = frame->height;
+
+  return buffer->texture;
+}
+
+// Textures are locked again once the decoder doesn't reference them as reference frame anymore
+static void sdl_texture_pool_relock() {
+  SDL_LockMutex(texture_mutex);
+  for (int i = 0; i < TEXTURE_POOL_SIZE; i++) {
+    struct texture_buffer* buffer = &texture_pool[i];
+    if (buffer->state == TEXTURE_RELEASED)
+      buffer->state = SDL_LockTexture(buffer->texture, NULL, (void**) &buffer->pixels, &buffer->pitch) < 0 ? TEXTURE_UNUSED : TEXTURE_FREE;
+  }
+  SDL_UnlockMutex(texture_mutex);
+}
+
+static void sdl_present() {
+  SDL_RenderPresent(renderer);
+
+  Uint64 now = SDL_GetPerformanceCounter();
+  if (last_present != 0) {
+    double interval = (now - last_present) * 1000.0 / SDL_GetPerformanceFrequency();
+    presents++;
+    present_sum += interval;
+    present_square_sum += interval * interval;
+    if (interval > present_max)
+      present_max = interval;
+  }
+  last_present = now;
+
+  // The performance counter may use another clock than the pacer
+  if (present_vsync) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    pacer_vsync(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
   }
 }
 
 void sdl_loop() {
   SDL_Event event;
+  int motion_delay = 0;
 
   SDL_SetRelativeMouseMode(SDL_TRUE);
 
-  while(!done && SDL_WaitEvent(&event)) {
+  while(!done) {
+    // Wake up in time to send mouse motion held back by the rate limit
+    if (motion_delay > 0 ? !SDL_WaitEventTimeout(&event, motion_delay) : !SDL_WaitEvent(&event)) {
+      if (motion_delay == 0)
+        break;
+
+      motion_delay = mouse_motion_flush(false);
+      continue;
+    }
+
     switch (sdlinput_handle_event(window, &event)) {
     case SDL_QUIT_APPLICATION:
       done = true;
@@ -96,23 +419,48 @@ void sdl_loop() {
         done = true;
       else if (event.type == SDL_USEREVENT) {
         if (event.user.code == SDL_CODE_FRAME) {
-          if (++sdlCurrentFrame <= sdlNextFrame - SDL_BUFFER_FRAMES) {
-            //Skip frame
-          } else if (SDL_LockMutex(mutex) == 0) {
-            Uint8** data = ((Uint8**) event.user.data1);
-            int* linesize = ((int*) event.user.data2);
-            SDL_UpdateYUVTexture(bmp, NULL, data[0], linesize[0], data[1], linesize[1], data[2], linesize[2]);
-            SDL_UnlockMutex(mutex);
-            SDL_RenderClear(renderer);
-            SDL_RenderCopy(renderer, bmp, NULL, NULL);
-            SDL_RenderPresent(renderer);
-          } else
-            fprintf(stderr, "Couldn't lock mutex\n");
+          AVFrame* frame = __atomic_exchange_n(&mailbox, NULL, __ATOMIC_ACQ_REL);
+          if (frame != NULL) {
+            SDL_Rect rect;
+            SDL_Texture* texture = texture_mutex ? sdl_texture_pool_show(frame, &rect) : NULL;
+            bool draw = texture != NULL || sdl_update_texture(frame);
+
+            av_frame_free(&frame);
+            if (draw) {
+              SDL_RenderClear(renderer);
+              SDL_RenderCopy(renderer, texture ? texture : bmp, texture ? &rect : NULL, NULL);
+              sdl_present();
+            }
+
+            if (texture_mutex)
+              sdl_texture_pool_relock();
+          }
         }
       }
     }
+
+    // Motion is sent once all queued events are handled
+    if (!SDL_HasEvents(SDL_FIRSTEVENT, SDL_LASTEVENT))
+      motion_delay = mouse_motion_flush(false);
   }
 
+  AVFrame* frame = __atomic_exchange_n(&mailbox, NULL, __ATOMIC_ACQ_REL);
+  av_frame_free(&frame);
+
+  if (frames_replaced > 0)
+    printf("SDL: %u frames replaced by a newer frame before they were drawn\n", frames_replaced);
+  if (presents > 0) {
+    double average = present_sum / presents;
+    double variance = present_square_sum / presents - average * average;
+    printf("SDL: %.2f ms average present interval, %.2f ms deviation, %.2f ms maximum\n", average, variance > 0 ? sqrt(variance) : 0, present_max);
+  }
+}
+
+// The decoder may still draw into textures until the video renderer is cleaned up
+void sdl_destroy() {
+  AVFrame* frame = __atomic_exchange_n(&mailbox, NULL, __ATOMIC_ACQ_REL);
+  av_frame_free(&frame);
+
   SDL_DestroyWindow(window);
   SDL_Quit();
 }
@@ -21,6 +21,9 @@
 
 #include <SDL.h>
 
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+
 #include <stdbool.h>
 
 #define SDL_NOTHING 0
@@ -33,10 +36,13 @@
 
 #define SDL_BUFFER_FRAMES 2
 
-void sdl_init(int width, int height, bool fullscreen);
+void sdl_init(int width, int height, bool fullscreen, int vsync);
 void sdl_loop();
+void sdl_destroy();
+void sdl_queue_frame(AVFrame* frame);
 
-extern SDL_mutex *mutex;
-extern int sdlCurrentFrame, sdlNextFrame;
+int sdl_texture_pool_init(int width, int height);
+void sdl_texture_pool_destroy();
+int sdl_get_texture_buffer(AVCodecContext* ctx, AVFrame* frame, int flags);
 
 #endif /* HAVE_SDL */
@@ -18,17 +18,49 @@
  */
 
 #include "egl.h"
+#include "video.h"
 
 #include <Limelight.h>
 
+#include <libavutil/pixdesc.h>
+
 #include <GLES2/gl2.h>
 
+#include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <unistd.h>
 
+// Pixel buffer objects are core in GLES3, the GLES2 headers don't define them
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_INVALIDATE_BUFFER_BIT
+#define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+#endif
+// Same value for GLES3 and GL_EXT_unpack_subimage
+#ifndef GL_UNPACK_ROW_LENGTH
+#define GL_UNPACK_ROW_LENGTH 0x0CF2
+#endif
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+#define PBO_SLOTS 3
+
+typedef void* (*PFN_MAP_BUFFER_RANGE)(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
+typedef GLboolean (*PFN_UNMAP_BUFFER)(GLenum target);
+typedef EGLDisplay (*PFN_GET_PLATFORM_DISPLAY)(EGLenum platform, void* native_display, const EGLint* attributes);
+
+static const EGLint context_attributes_gles3[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE };
 static const EGLint context_attributes[] = { EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE };
 static const char* texture_mappings[] = { "ymap", "umap", "vmap" };
 static const char* vertex_source = "\
@@ -41,16 +73,17 @@ void main() {\
 }\
 ";
 
-static const char* fragment_source = "\
+static const char fragment_source_yuv420p[] = "\
 uniform lowp sampler2D ymap;\
 uniform lowp sampler2D umap;\
 uniform lowp sampler2D vmap;\
+uniform mediump vec3 crop;\
 varying mediump vec2 tex_position;\
 \
 void main() {\
-  mediump float y = texture2D(ymap, tex_position).r;\
-  mediump float u = texture2D(umap, tex_position).r - .5;\n\
-  mediump float v = texture2D(vmap, tex_position).r - .5;\n\
+  mediump float y = texture2D(ymap, tex_position * vec2(crop.x, 1.)).r;\
+  mediump float u = texture2D(umap, tex_position * vec2(crop.y, 1.)).r - .5;\n\
+  mediump float v = texture2D(vmap, tex_position * vec2(crop.z, 1.)).r - .5;\n\
   lowp float r = y + 1.28033 * v;\
   lowp float g = y - .21482 * u - .38059 * v;\
   lowp float b = y + 2.12798 * u;\
@@ -58,6 +91,66 @@ void main() {\
 }\
 ";
 
+// Interleaved chroma is uploaded as luminance alpha, U ends up in red and V in alpha
+static const char fragment_source_nv12[] = "\
+uniform lowp sampler2D ymap;\
+uniform lowp sampler2D umap;\
+uniform mediump vec3 crop;\
+varying mediump vec2 tex_position;\
+\
+void main() {\
+  mediump float y = texture2D(ymap, tex_position * vec2(crop.x, 1.)).r;\
+  mediump vec2 uv = texture2D(umap, tex_position * vec2(crop.y, 1.)).ra - .5;\
+  lowp float r = y + 1.28033 * uv.y;\
+  lowp float g = y - .21482 * uv.x - .38059 * uv.y;\
+  lowp float b = y + 2.12798 * uv.x;\
+  gl_FragColor = vec4(r, g, b, 1.0);\
+}\
+";
+
+// GLES2 has no 16 bit textures, so both bytes of a sample are uploaded as separate channels and combined here
+static const char fragment_source_p010[] = "\
+#ifdef GL_FRAGMENT_PRECISION_HIGH\n\
+precision highp float;\n\
+#else\n\
+precision mediump float;\n\
+#endif\n\
+uniform sampler2D ymap;\
+uniform sampler2D umap;\
+uniform vec3 crop;\
+varying vec2 tex_position;\
+\
+void main() {\
+  const vec2 word = vec2(255. / 65535., 65280. / 65535.);\
+  float y = dot(texture2D(ymap, tex_position * vec2(crop.x, 1.)).ra, word);\
+  vec4 uv = texture2D(umap, tex_position * vec2(crop.y, 1.));\
+  float u = dot(uv.rg, word) - .5;\
+  float v = dot(uv.ba, word) - .5;\
+  float r = y + 1.28033 * v;\
+  float g = y - .21482 * u - .38059 * v;\
+  float b = y + 2.12798 * u;\
+  gl_FragColor = vec4(r, g, b, 1.0);\
+}\
+";
+
+enum shader_format { FORMAT_YUV420P, FORMAT_NV12, FORMAT_P010, FORMAT_COUNT };
+
+struct texture_format {
+  GLenum format;
+  int bytes_per_pixel;
+  bool subsampled;
+};
+
+static const struct {
+  const char* fragment_source;
+  int planes;
+  struct texture_format textures[3];
+} formats[FORMAT_COUNT] = {
+  [FORMAT_YUV420P] = { fragment_source_yuv420p, 3, {{ GL_LUMINANCE, 1, false }, { GL_LUMINANCE, 1, true }, { GL_LUMINANCE, 1, true }} },
+  [FORMAT_NV12] = { fragment_source_nv12, 2, {{ GL_LUMINANCE, 1, false }, { GL_LUMINANCE_ALPHA, 2, true }} },
+  [FORMAT_P010] = { fragment_source_p010, 2, {{ GL_LUMINANCE_ALPHA, 2, false }, { GL_RGBA, 4, true }} },
+};
+
 static const float vertices[] = {
   -1.f,  1.f,
   -1.f, -1.f,
@@ -76,16 +169,175 @@ static EGLContext context;
 
 static int width, height;
 static bool current;
+static bool headless;
+
+void (*egl_timing_handler)(uint64_t upload_ns, uint64_t draw_ns, uint64_t swap_ns);
+
+static GLuint texture_id[3];
+static GLuint shader_program[FORMAT_COUNT];
+static GLint texture_uniform[FORMAT_COUNT][3], crop_uniform[FORMAT_COUNT];
+
+// Without GL_UNPACK_ROW_LENGTH padded rows are uploaded whole and cropped in the shader
+static bool gles3, unpack_row_length;
+static int texture_format = -1;
+static int texture_width[3];
+static int unsupported_format = -1;
+
+static PFN_MAP_BUFFER_RANGE map_buffer_range;
+static PFN_UNMAP_BUFFER unmap_buffer;
+static GLuint pbo[PBO_SLOTS];
+static GLsizeiptr pbo_size[PBO_SLOTS];
+static int pbo_index;
+static bool use_pbo;
+
+static unsigned int frames_drawn;
+static uint64_t upload_time;
+
+static int vsync_mode, swap_interval;
+static bool vsync_confirmed;
+static uint64_t late_threshold;
+static uint64_t last_present, last_vsync;
+static unsigned int presents;
+static double present_sum, present_square_sum, present_max;
+
+static uint64_t egl_time_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-static GLuint texture_id[3], texture_uniform[3];
-static GLuint shader_program;
+static int format_from_frame(AVFrame* frame) {
+  switch (frame->format) {
+  case AV_PIX_FMT_YUV420P:
+  case AV_PIX_FMT_YUVJ420P:
+    return FORMAT_YUV420P;
+  case AV_PIX_FMT_NV12:
+    return FORMAT_NV12;
+  case AV_PIX_FMT_P010:
+    return FORMAT_P010;
+  }
+  return -1;
+}
 
-void egl_init(EGLNativeDisplayType native_display, NativeWindowType native_window, int display_width, int display_height) {
-  width = display_width;
-  height = display_height;
+static int plane_width(int format, int plane) {
+  return formats[format].textures[plane].subsampled ? (width + 1) / 2 : width;
+}
 
-  // get an EGL display connection
-  display = eglGetDisplay(native_display);
+static int plane_height(int format, int plane) {
+  return formats[format].textures[plane].subsampled ? (height + 1) / 2 : height;
+}
+
+static GLuint egl_compile_program(GLuint vertex_shader, const char* fragment_source) {
+  GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(fragment_shader, 1, &fragment_source, NULL);
+  glCompileShader(fragment_shader);
+
+  GLuint program = glCreateProgram();
+  glAttachShader(program, vertex_shader);
+  glAttachShader(program, fragment_shader);
+  glBindAttribLocation(program, 0, "position");
+  glLinkProgram(program);
+  // Freed together with the program
+  glDeleteShader(fragment_shader);
+
+  return program;
+}
+
+// Only a GLES3 context can upload from a pixel buffer object
+static void egl_init_pbo() {
+  if (!gles3)
+    return;
+
+  map_buffer_range = (PFN_MAP_BUFFER_RANGE) eglGetProcAddress("glMapBufferRange");
+  unmap_buffer = (PFN_UNMAP_BUFFER) eglGetProcAddress("glUnmapBuffer");
+  if (map_buffer_range == NULL || unmap_buffer == NULL)
+    return;
+
+  // Storage is allocated on first use, once the stride of the frames is known
+  glGenBuffers(PBO_SLOTS, pbo);
+  for (int i = 0; i < PBO_SLOTS; i++)
+    pbo_size[i] = 0;
+
+  pbo_index = 0;
+  use_pbo = true;
+}
+
+// (Re)allocates the textures when the pixel format or the stride of a plane changes
+static void egl_setup_textures(int format, int linesize[3]) {
+  for (int i = 0; i < formats[format].planes; i++) {
+    const struct texture_format* texture = &formats[format].textures[i];
+    int tex_width = unpack_row_length || use_pbo ? plane_width(format, i) : linesize[i] / texture->bytes_per_pixel;
+    if (format == texture_format && tex_width == texture_width[i])
+      continue;
+
+    glBindTexture(GL_TEXTURE_2D, texture_id[i]);
+    glTexImage2D(GL_TEXTURE_2D, 0, texture->format, tex_width, plane_height(format, i), 0, texture->format, GL_UNSIGNED_BYTE, 0);
+    texture_width[i] = tex_width;
+  }
+  texture_format = format;
+}
+
+// Copies each plane with its padding into the next buffer of the ring in one go, the texture update
+// then skips the padding with GL_UNPACK_ROW_LENGTH and doesn't block on the GPU
+static bool egl_upload_pbo(int format, uint8_t* image[3], int linesize[3]) {
+  size_t offset[3];
+  GLsizeiptr size = 0;
+  for (int i = 0; i < formats[format].planes; i++) {
+    int bytes_per_pixel = formats[format].textures[i].bytes_per_pixel;
+    if (linesize[i] < plane_width(format, i) * bytes_per_pixel || linesize[i] % bytes_per_pixel != 0)
+      return false;
+
+    offset[i] = size;
+    size += (GLsizeiptr) linesize[i] * plane_height(format, i);
+  }
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[pbo_index]);
+  if (size > pbo_size[pbo_index]) {
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+    pbo_size[pbo_index] = size;
+  }
+
+  uint8_t* buffer = map_buffer_range(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (buffer == NULL) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return false;
+  }
+
+  for (int i = 0; i < formats[format].planes; i++)
+    memcpy(buffer + offset[i], image[i], (size_t) linesize[i] * plane_height(format, i));
+  unmap_buffer(GL_PIXEL_UNPACK_BUFFER);
+
+  for (int i = 0; i < formats[format].planes; i++) {
+    const struct texture_format* texture = &formats[format].textures[i];
+    glActiveTexture(GL_TEXTURE0 + i);
+    glBindTexture(GL_TEXTURE_2D, texture_id[i]);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, linesize[i] / texture->bytes_per_pixel);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, plane_width(format, i), plane_height(format, i), texture->format, GL_UNSIGNED_BYTE, (const void*) offset[i]);
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  pbo_index = (pbo_index + 1) % PBO_SLOTS;
+  return true;
+}
+
+static void egl_upload(int format, uint8_t* image[3], int linesize[3]) {
+  for (int i = 0; i < formats[format].planes; i++) {
+    const struct texture_format* texture = &formats[format].textures[i];
+    glActiveTexture(GL_TEXTURE0 + i);
+    glBindTexture(GL_TEXTURE_2D, texture_id[i]);
+    if (unpack_row_length) {
+      glPixelStorei(GL_UNPACK_ROW_LENGTH, linesize[i] / texture->bytes_per_pixel);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, plane_width(format, i), plane_height(format, i), texture->format, GL_UNSIGNED_BYTE, image[i]);
+    } else
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texture_width[i], plane_height(format, i), texture->format, GL_UNSIGNED_BYTE, image[i]);
+  }
+
+  if (unpack_row_length)
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+static EGLConfig egl_init_context(EGLint surface_type) {
   if (display == EGL_NO_DISPLAY) {
     fprintf( stderr, "EGL: error get display\n" );
     exit(EXIT_FAILURE);
@@ -101,7 +353,7 @@ void egl_init(EGLNativeDisplayType native_display, NativeWindowType native_windo
 
   // get our config from the config class
   EGLConfig config = NULL;
-  static const EGLint attribute_list[] = { EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8, EGL_SURFACE_TYPE, EGL_WINDOW_BIT, EGL_NONE };
+  const EGLint attribute_list[] = { EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8, EGL_SURFACE_TYPE, surface_type, EGL_NONE };
 
   EGLint totalConfigsFound = 0;
   result = eglChooseConfig(display, attribute_list, &config, 1, &totalConfigsFound);
@@ -117,18 +369,37 @@ void egl_init(EGLNativeDisplayType native_display, NativeWindowType native_windo
     exit(EXIT_FAILURE);
   }
 
-  // create an EGL rendering context
-  context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attributes);
+  // create an EGL rendering context, preferably GLES3 for asynchronous texture uploads
+  context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attributes_gles3);
+  if (context == EGL_NO_CONTEXT)
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attributes);
   if (context == EGL_NO_CONTEXT) {
     fprintf(stderr, "EGL: couldn't get a valid context\n");
     exit(EXIT_FAILURE);
   }
 
-  // finally we can create a new surface using this config and window
-  surface = eglCreateWindowSurface(display, config, (NativeWindowType) native_window, NULL);
+  return config;
+}
+
+static void egl_init_gl(int redraw_rate, int vsync) {
   eglMakeCurrent(display, surface, surface, context);
 
+  // Without a mode the driver default is used, adaptive mode switches per frame
+  vsync_mode = vsync;
+  swap_interval = vsync == VSYNC_OFF ? 0 : 1;
+  // The driver default may not wait for the refresh, so only a swap interval we set is trusted
+  vsync_confirmed = false;
+  if (vsync != VSYNC_DEFAULT)
+    vsync_confirmed = eglSwapInterval(display, swap_interval) == EGL_TRUE && swap_interval != 0;
+  late_threshold = redraw_rate > 0 ? 1500000000ULL / redraw_rate : 0;
+
   glEnable(GL_TEXTURE_2D);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+  const char* version = (const char*) glGetString(GL_VERSION);
+  const char* extensions = (const char*) glGetString(GL_EXTENSIONS);
+  gles3 = version != NULL && strncmp(version, "OpenGL ES ", 10) == 0 && version[10] >= '3';
+  unpack_row_length = gles3 || (extensions != NULL && strstr(extensions, "GL_EXT_unpack_subimage") != NULL);
 
   GLuint vbo;
   glGenBuffers(1, &vbo);
@@ -144,16 +415,13 @@ void egl_init(EGLNativeDisplayType native_display, NativeWindowType native_windo
   glShaderSource(vertex_shader, 1, &vertex_source, NULL);
   glCompileShader(vertex_shader);
 
-  GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fragment_shader, 1, &fragment_source, NULL);
-  glCompileShader(fragment_shader);
-
-  shader_program = glCreateProgram();
-  glAttachShader(shader_program, vertex_shader);
-  glAttachShader(shader_program, fragment_shader);
-
-  glLinkProgram(shader_program);
-  glBindAttribLocation(shader_program, 0, "position");
+  for (int format = 0; format < FORMAT_COUNT; format++) {
+    shader_program[format] = egl_compile_program(vertex_shader, formats[format].fragment_source);
+    for (int i = 0; i < formats[format].planes; i++)
+      texture_uniform[format][i] = glGetUniformLocation(shader_program[format], texture_mappings[i]);
+    crop_uniform[format] = glGetUniformLocation(shader_program[format], "crop");
+  }
+  glDeleteShader(vertex_shader);
   glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), 0);
 
   glGenTextures(3, texture_id);
@@ -161,37 +429,158 @@ void egl_init(EGLNativeDisplayType native_display, NativeWindowType native_windo
     glBindTexture(GL_TEXTURE_2D, texture_id[i]);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, i > 0 ? width / 2 : width, i > 0 ? height / 2 : height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, 0);
-
-    texture_uniform[i] = glGetUniformLocation(shader_program, texture_mappings[i]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
   }
+  texture_format = -1;
+  unsupported_format = -1;
+
+  use_pbo = false;
+  egl_init_pbo();
+  frames_drawn = 0;
+  upload_time = 0;
+  last_present = last_vsync = 0;
+  presents = 0;
+  present_sum = present_square_sum = present_max = 0;
 
   eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 }
 
-void egl_draw(uint8_t* image[3]) {
+void egl_init(EGLNativeDisplayType native_display, NativeWindowType native_window, int display_width, int display_height, int redraw_rate, int vsync) {
+  width = display_width;
+  height = display_height;
+  headless = false;
+
+  // get an EGL display connection
+  display = eglGetDisplay(native_display);
+  EGLConfig config = egl_init_context(EGL_WINDOW_BIT);
+
+  // finally we can create a new surface using this config and window
+  surface = eglCreateWindowSurface(display, config, (NativeWindowType) native_window, NULL);
+  egl_init_gl(redraw_rate, vsync);
+}
+
+// Renders to a pbuffer, preferably on the surfaceless platform which doesn't need a display server
+void egl_init_headless(int display_width, int display_height) {
+  width = display_width;
+  height = display_height;
+  headless = true;
+
+  display = EGL_NO_DISPLAY;
+  const char* client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (client_extensions != NULL && strstr(client_extensions, "EGL_MESA_platform_surfaceless") != NULL) {
+    PFN_GET_PLATFORM_DISPLAY get_platform_display = (PFN_GET_PLATFORM_DISPLAY) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display != NULL)
+      display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  }
+  if (display == EGL_NO_DISPLAY)
+    display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+  EGLConfig config = egl_init_context(EGL_PBUFFER_BIT);
+
+  const EGLint pbuffer_attributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+  surface = eglCreatePbufferSurface(display, config, pbuffer_attributes);
+  if (surface == EGL_NO_SURFACE) {
+    fprintf(stderr, "EGL: couldn't create pbuffer surface\n");
+    exit(EXIT_FAILURE);
+  }
+  egl_init_gl(0, VSYNC_DEFAULT);
+}
+
+void egl_draw(AVFrame* frame) {
+  int format = format_from_frame(frame);
+  if (format < 0) {
+    if (frame->format != unsupported_format) {
+      fprintf(stderr, "EGL: unsupported pixel format %s\n", av_get_pix_fmt_name(frame->format));
+      unsupported_format = frame->format;
+    }
+    return;
+  }
+
   if (!current) {
     eglMakeCurrent(display, surface, surface, context);
     current = true;
   }
 
-  glUseProgram(shader_program);
+  glUseProgram(shader_program[format]);
   glEnableVertexAttribArray(0);
 
-  for (int i = 0; i < 3; i++) {
-    glActiveTexture(GL_TEXTURE0 + i);
-    glBindTexture(GL_TEXTURE_2D, texture_id[i]);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, i > 0 ? width / 2 : width, i > 0 ? height / 2 : height, GL_LUMINANCE, GL_UNSIGNED_BYTE, image[i]);
-    glUniform1i(texture_uniform[i], i);
+  uint64_t start = egl_time_ns();
+  egl_setup_textures(format, frame->linesize);
+  if (!use_pbo || !egl_upload_pbo(format, frame->data, frame->linesize))
+    egl_upload(format, frame->data, frame->linesize);
+  uint64_t uploaded = egl_time_ns();
+  upload_time += uploaded - start;
+  frames_drawn++;
+
+  float crop[3] = { 1, 1, 1 };
+  for (int i = 0; i < formats[format].planes; i++) {
+    glUniform1i(texture_uniform[format][i], i);
+    crop[i] = (float) plane_width(format, i) / texture_width[i];
   }
+  glUniform3f(crop_uniform[format], crop[0], crop[1], crop[2]);
 
   glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+  uint64_t drawn = egl_time_ns();
+
+  // Like adaptive vsync, a frame arriving too late for the next refresh is presented immediately
+  if (vsync_mode == VSYNC_ADAPTIVE && last_present != 0) {
+    int interval = egl_time_ns() - last_present > late_threshold ? 0 : 1;
+    if (interval != swap_interval) {
+      eglSwapInterval(display, interval);
+      swap_interval = interval;
+    }
+  }
 
   eglSwapBuffers(display, surface);
+  // A pbuffer isn't presented, wait for the GPU instead so the frames can't pile up
+  if (headless)
+    glFinish();
+
+  uint64_t now = egl_time_ns();
+  last_vsync = vsync_confirmed && !headless && swap_interval != 0 ? now : 0;
+  if (egl_timing_handler != NULL)
+    egl_timing_handler(uploaded - start, drawn - uploaded, now - drawn);
+
+  if (last_present != 0) {
+    double interval = (now - last_present) / 1000000.0;
+    presents++;
+    present_sum += interval;
+    present_square_sum += interval * interval;
+    if (interval > present_max)
+      present_max = interval;
+  }
+  last_present = now;
+}
+
+uint64_t egl_vsync_time() {
+  return last_vsync;
 }
 
 void egl_destroy() {
+  if (frames_drawn > 0)
+    printf("EGL: %.2f ms average texture upload over %u frames (%s)\n", upload_time / 1000000.0 / frames_drawn, frames_drawn, use_pbo ? "pixel buffer objects" : "direct");
+
+  if (presents > 0) {
+    double average = present_sum / presents;
+    double variance = present_square_sum / presents - average * average;
+    printf("EGL: %.2f ms average present interval, %.2f ms deviation, %.2f ms maximum\n", average, variance > 0 ? sqrt(variance) : 0, present_max);
+  }
+
+  // The thread which drew keeps the context current, otherwise it's made current here. That fails
+  // while another thread still has it, then the objects go with the context.
+  if (!current)
+    current = eglMakeCurrent(display, surface, surface, context) == EGL_TRUE;
+  if (current) {
+    if (use_pbo)
+      glDeleteBuffers(PBO_SLOTS, pbo);
+    glDeleteTextures(3, texture_id);
+    for (int format = 0; format < FORMAT_COUNT; format++)
+      glDeleteProgram(shader_program[format]);
+  }
+
   eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  current = false;
   eglDestroySurface(display, surface);
   eglDestroyContext(display, context);
   eglTerminate(display);
@@ -19,6 +19,16 @@
 
 #include <EGL/egl.h>
 
-void egl_init(EGLNativeDisplayType native_display, NativeWindowType native_window, int display_width, int display_height);
-void egl_draw(uint8_t* image[3]);
+#include <libavutil/frame.h>
+
+#include <stdint.h>
+
+// Called with the time spent on each stage of every drawn frame
+extern void (*egl_timing_handler)(uint64_t upload_ns, uint64_t draw_ns, uint64_t swap_ns);
+
+void egl_init(EGLNativeDisplayType native_display, NativeWindowType native_window, int display_width, int display_height, int redraw_rate, int vsync);
+void egl_init_headless(int display_width, int display_height);
+void egl_draw(AVFrame* frame);
+// CLOCK_MONOTONIC time in ns the last frame was presented waiting for a refresh, 0 without vsync
+uint64_t egl_vsync_time();
 void egl_destroy();
@@ -0,0 +1,120 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2015 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "video.h"
+#include "ffmpeg.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Decodes with FFmpeg and discards the frames, to measure the client without a display
+
+static PFFMPEG_CONTEXT decoder;
+static int queue_depth;
+
+static bool report;
+static unsigned int frames_decoded;
+static uint64_t report_time;
+static double report_cpu;
+
+void (*fake_frame_handler)(int frameNumber);
+
+static double process_cpu_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// CPU time is for the whole process, as FFmpeg decodes on its own threads too
+static void fake_report(uint64_t now) {
+  unsigned int frames = __atomic_exchange_n(&frames_decoded, 0, __ATOMIC_RELAXED);
+  double cpu = process_cpu_ms();
+  double elapsed = (now - report_time) / 1000.0;
+
+  printf("Video: %.1f fps decoded, %.2f ms CPU per frame, %d frames pending, %d queued for decoding\n", frames / elapsed, frames > 0 ? (cpu - report_cpu) / frames : 0, LiGetPendingVideoFrames(), ffmpeg_queued_units(decoder));
+  report_time = now;
+  report_cpu = cpu;
+}
+
+static void fake_frame_decoded(PFFMPEG_CONTEXT ctx) {
+  AVFrame* frame = ffmpeg_get_frame(ctx, true);
+  if (frame != NULL)
+    __atomic_add_fetch(&frames_decoded, 1, __ATOMIC_RELAXED);
+
+  // The frame number travels through the decoder in the packet's opaque field
+  if (frame != NULL && fake_frame_handler != NULL)
+    fake_frame_handler(ffmpeg_frame_number(frame));
+}
+
+static void fake_cleanup();
+
+static int fake_setup(int videoFormat, int width, int height, int redrawRate, void* context, int drFlags) {
+  int thread_count;
+  int avc_flags = ffmpeg_threading(videoFormat, width, height, redrawRate, &thread_count);
+  decoder = ffmpeg_init(videoFormat, width, height, avc_flags, 2, thread_count, context, NULL);
+  if (decoder == NULL) {
+    fprintf(stderr, "Couldn't initialize video decoding\n");
+    return -1;
+  }
+
+  queue_depth = (drFlags & DECODE_QUEUE_MASK) >> DECODE_QUEUE_SHIFT;
+  if (queue_depth > 0 && ffmpeg_start_decode_thread(decoder, queue_depth, fake_frame_decoded) < 0) {
+    fprintf(stderr, "Couldn't start decode thread\n");
+    fake_cleanup();
+    return -1;
+  }
+
+  // The benchmark collects its own statistics through the frame handler
+  report = fake_frame_handler == NULL;
+  frames_decoded = 0;
+  report_time = LiGetMillis();
+  report_cpu = process_cpu_ms();
+
+  return 0;
+}
+
+static void fake_cleanup() {
+  ffmpeg_destroy(decoder);
+  decoder = NULL;
+}
+
+static int fake_submit_decode_unit(PDECODE_UNIT decodeUnit) {
+  if (report) {
+    uint64_t now = LiGetMillis();
+    if (now - report_time >= 1000)
+      fake_report(now);
+  }
+
+  if (queue_depth > 0)
+    return ffmpeg_queue_decode_unit(decoder, decodeUnit);
+
+  int ret = ffmpeg_decode_unit(decoder, decodeUnit);
+  fake_frame_decoded(decoder);
+
+  return ret;
+}
+
+DECODER_RENDERER_CALLBACKS decoder_callbacks_fake = {
+  .setup = fake_setup,
+  .cleanup = fake_cleanup,
+  .submitDecodeUnit = fake_submit_decode_unit,
+  .capabilities = CAPABILITY_REFERENCE_FRAME_INVALIDATION_AVC | CAPABILITY_REFERENCE_FRAME_INVALIDATION_HEVC | CAPABILITY_REFERENCE_FRAME_INVALIDATION_AV1 | CAPABILITY_DIRECT_SUBMIT,
+};
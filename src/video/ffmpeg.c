@@ -18,6 +18,9 @@
  */
 
 #include "ffmpeg.h"
+#include "video.h"
+
+#include "../cpu.h"
 
 #ifdef HAVE_VAAPI
 #include "ffmpeg_vaapi.h"
@@ -25,179 +28,587 @@
 
 #include <Limelight.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/dict.h>
 
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <sys/utsname.h>
+
+// Recovery from decode errors, times in ms
+#define IDR_REQUEST_TIMEOUT_MS 1000
+
+// After lost frames the host invalidates the missing references instead of sending an IDR frame,
+// decode errors until its recovery frame arrives are expected
+#define RFI_WINDOW_FRAMES 30
+#define RFI_MAX_ERRORS 4
+
+struct _FFMPEG_CONTEXT {
+  // General decoder and renderer state
+  enum decoders decoder_type;
+  AVPacket* pkt;
+  const AVCodec* decoder;
+  AVCodecContext* decoder_ctx;
+  AVFrame** dec_frames;
+  int dec_frames_cnt;
+  int current_frame, next_frame;
+
+  // Decode units are assembled into refcounted buffers from this pool, so
+  // libavcodec can keep a reference instead of copying the packet again
+  AVBufferPool* packet_pool;
+  size_t packet_buffer_size;
+
+  // Optional decode thread fed from a single producer, single consumer ring
+  pthread_t decode_thread;
+  bool decode_thread_started, decode_thread_stop;
+  sem_t decode_queue_sem;
+  AVPacket** decode_queue;
+  int* decode_queue_frames;
+  unsigned int decode_queue_depth;
+  unsigned int decode_queue_head, decode_queue_tail, decode_queue_flush;
+  bool waiting_for_idr;
+  void (*decoded_handler)(PFFMPEG_CONTEXT ctx);
+
+  // Frames are received here first, so only the newest one takes a slot in dec_frames
+  AVFrame* drain_frame;
+  unsigned int frames_received, frames_skipped;
+
+  // Set when an IDR frame is needed after the submit call returned, it is requested with the next unit
+  bool need_idr;
+
+  uint64_t error_time, idr_request_time;
+  bool recovery_frame;
+  unsigned int decode_errors, idr_requests, recoveries;
+  uint64_t recovery_time_total, recovery_time_max;
+
+  // A gap opens a window in which the host may recover by reference frame invalidation
+  int last_frame_number, rfi_frame;
+  bool rfi_recovered;
+  unsigned int rfi_errors, frames_lost, rfi_recoveries;
+};
+
+static int ffmpeg_decode_error(PFFMPEG_CONTEXT ctx);
 
-// General decoder and renderer state
-static AVPacket* pkt;
-static const AVCodec* decoder;
-static AVCodecContext* decoder_ctx;
-static AVFrame** dec_frames;
+#define BYTES_PER_PIXEL 4
 
-static int dec_frames_cnt;
-static int current_frame, next_frame;
+#define DECODER_CACHE_FILE_NAME "decoders.dat"
 
-enum decoders ffmpeg_decoder;
+// Upper bound for slices requested from the host and decoder threads
+#define MAX_DECODER_THREADS 8
 
-#define BYTES_PER_PIXEL 4
+int ffmpeg_threading(int videoFormat, int width, int height, int fps, int* thread_count) {
+  int big_cores;
+  int cores = cpu_count(&big_cores);
+
+  // Little cores are counted as half a big core
+  int perf_cores = big_cores + (cores - big_cores) / 2;
+
+  // Decoding load relative to 1080p60, which a single core is expected to handle
+  double load = (double) width * height * fps / (1920 * 1080 * 60);
+
+  *thread_count = 1;
+  if (perf_cores <= 1)
+    return 0;
+
+  // Dav1d splits the work over its own tile and frame threads
+  if (videoFormat & VIDEO_FORMAT_MASK_AV1) {
+    *thread_count = perf_cores < MAX_DECODER_THREADS ? perf_cores : MAX_DECODER_THREADS;
+    return SLICE_THREADING;
+  }
+
+  // Slice threading doesn't add latency but scales worse, as slices aren't equally
+  // complex. Only fall back to frame threading if slices can't keep up.
+  int threads = (int) ceil(load * 4);
+  if (load * 2 <= perf_cores || perf_cores < 4) {
+    if (threads < 2)
+      threads = 2;
+    if (threads > perf_cores)
+      threads = perf_cores;
+    if (threads > MAX_DECODER_THREADS)
+      threads = MAX_DECODER_THREADS;
+
+    *thread_count = threads;
+    return SLICE_THREADING;
+  }
+
+  // Every extra frame thread delays output by a frame
+  *thread_count = perf_cores < MAX_DECODER_THREADS ? perf_cores : MAX_DECODER_THREADS;
+  return FRAME_THREADING;
+}
+
+bool ffmpeg_prefers_av1(int width, int height, int fps) {
+  if (avcodec_find_decoder_by_name("libdav1d") == NULL || !has_fast_simd())
+    return false;
+
+  int big_cores;
+  int cores = cpu_count(&big_cores);
+  int perf_cores = big_cores + (cores - big_cores) / 2;
+  double load = (double) width * height * fps / (1920 * 1080 * 60);
+
+  // Dav1d needs about two cores for 1080p60, keep some headroom for the rest of the client
+  return perf_cores >= 4 && load * 3 <= perf_cores;
+}
+
+// Slices the host should encode per frame, one for each slice thread of the decoder.
+// The codec is negotiated later, so this follows the H.264 and HEVC formats the client supports.
+int ffmpeg_slices_per_frame(int videoFormats, int width, int height, int fps, enum decoders decoder) {
+  // Hardware decoders don't benefit, and AV1 is split in tiles instead
+  if (decoder != SOFTWARE || !(videoFormats & (VIDEO_FORMAT_MASK_H264 | VIDEO_FORMAT_MASK_H265)))
+    return 1;
+
+  int thread_count;
+  int videoFormat = videoFormats & VIDEO_FORMAT_MASK_H264 ? VIDEO_FORMAT_H264 : VIDEO_FORMAT_H265;
+  if (ffmpeg_threading(videoFormat, width, height, fps, &thread_count) == SLICE_THREADING)
+    return thread_count;
+
+  return 1;
+}
+
+static const char* h264_decoders[] = {
+  "h264_nvv4l2", // Tegra
+  "h264_nvmpi", // Tegra
+  "h264_omx", // VisionFive
+  "h264_v4l2m2m", // Stateful V4L2
+  "h264", // Software and hwaccel
+  NULL
+};
+
+static const char* hevc_decoders[] = {
+  "hevc_nvv4l2", // Tegra
+  "hevc_nvmpi", // Tegra
+  "hevc_omx", // VisionFive
+  "hevc_v4l2m2m", // Stateful V4L2
+  "hevc", // Software and hwaccel
+  NULL
+};
+
+static const char* av1_decoders[] = {
+  "libdav1d",
+  "av1", // Hwaccel
+  NULL
+};
+
+
+// Identifies the combination of stream, FFmpeg build and kernel drivers
+// for which a probed decoder is valid
+static void ffmpeg_fingerprint(char* fingerprint, size_t size, int videoFormat, int width, int height, int perf_lvl) {
+  struct utsname name;
+  if (uname(&name) < 0)
+    name.release[0] = name.machine[0] = 0;
+
+  snprintf(fingerprint, size, "%x-%dx%d-%x-%x-%s-%s", videoFormat, width, height, perf_lvl & (VDPAU_ACCELERATION | VAAPI_ACCELERATION), avcodec_version(), name.release, name.machine);
+}
+
+static bool ffmpeg_cache_lookup(const char* cache_dir, const char* fingerprint, char* decoder_name, size_t size) {
+  char path[4096];
+  if (cache_dir == NULL)
+    return false;
+
+  snprintf(path, sizeof(path), "%s/%s", cache_dir, DECODER_CACHE_FILE_NAME);
+  FILE* fd = fopen(path, "r");
+  if (fd == NULL)
+    return false;
+
+  bool found = false;
+  char *line = NULL;
+  size_t len = 0;
+  while (!found && getline(&line, &len, fd) != -1) {
+    char *key = NULL, *value = NULL;
+    if (sscanf(line, "%ms %ms", &key, &value) == 2 && strcmp(key, fingerprint) == 0) {
+      snprintf(decoder_name, size, "%s", value);
+      found = true;
+    }
+    free(key);
+    free(value);
+  }
+
+  free(line);
+  fclose(fd);
+  return found;
+}
+
+static void ffmpeg_cache_store(const char* cache_dir, const char* fingerprint, const char* decoder_name) {
+  char path[4096], tmp_path[4096];
+  if (cache_dir == NULL)
+    return;
+
+  snprintf(path, sizeof(path), "%s/%s", cache_dir, DECODER_CACHE_FILE_NAME);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  FILE* out = fopen(tmp_path, "w");
+  if (out == NULL)
+    return;
+
+  // Keep the entries for other streams and configurations
+  FILE* in = fopen(path, "r");
+  if (in != NULL) {
+    char *line = NULL;
+    size_t len = 0;
+    size_t fingerprint_len = strlen(fingerprint);
+    while (getline(&line, &len, in) != -1) {
+      if (strncmp(line, fingerprint, fingerprint_len) != 0 || line[fingerprint_len] != ' ')
+        fputs(line, out);
+    }
+    free(line);
+    fclose(in);
+  }
+
+  fprintf(out, "%s %s\n", fingerprint, decoder_name);
+  fclose(out);
+
+  if (rename(tmp_path, path) < 0)
+    unlink(tmp_path);
+}
+
+static AVCodecContext* ffmpeg_open_decoder(const AVCodec* codec, int width, int height, int perf_lvl, int thread_count, FFmpegGetBuffer get_buffer) {
+  AVCodecContext* ctx = avcodec_alloc_context3(codec);
+  if (ctx == NULL) {
+    printf("Couldn't allocate context\n");
+    return NULL;
+  }
+
+  // Use low delay decoding, this disables frame threading in libavcodec
+  if (!(perf_lvl & FRAME_THREADING))
+    ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+
+  // Allow display of corrupt frames and frames missing references
+  ctx->flags |= AV_CODEC_FLAG_OUTPUT_CORRUPT;
+  #ifdef AV_CODEC_FLAG_COPY_OPAQUE
+  // Frames carry the number of their decode unit
+  ctx->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+  #endif
+  ctx->flags2 |= AV_CODEC_FLAG2_SHOW_ALL;
+
+  // Report decoding errors to allow us to request a key frame
+  ctx->err_recognition = AV_EF_EXPLODE;
+
+  if (perf_lvl & SLICE_THREADING) {
+    ctx->thread_type = FF_THREAD_SLICE;
+    ctx->thread_count = thread_count;
+  } else if (perf_lvl & FRAME_THREADING) {
+    ctx->thread_type = FF_THREAD_FRAME;
+    ctx->thread_count = thread_count;
+  } else {
+    ctx->thread_count = 1;
+  }
+
+  ctx->width = width;
+  ctx->height = height;
+  ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+
+  if (get_buffer != NULL && !(perf_lvl & (VDPAU_ACCELERATION | VAAPI_ACCELERATION)) && (codec->capabilities & AV_CODEC_CAP_DR1)) {
+    ctx->get_buffer2 = get_buffer;
+    #if LIBAVCODEC_VERSION_MAJOR < 59
+    ctx->thread_safe_callbacks = 1;
+    #endif
+  }
+
+  AVDictionary* options = NULL;
+  if (strcmp(codec->name, "libdav1d") == 0) {
+    // Return every frame as soon as it is decoded and spend the threads on tiles instead
+    av_dict_set_int(&options, "max_frame_delay", 1, 0);
+    av_dict_set_int(&options, "tilethreads", thread_count, 0);
+
+    // Applying film grain is expensive and the host doesn't send it for streaming
+    av_dict_set_int(&options, "filmgrain", 0, 0);
+    #ifdef AV_CODEC_EXPORT_DATA_FILM_GRAIN
+    ctx->export_side_data |= AV_CODEC_EXPORT_DATA_FILM_GRAIN;
+    #endif
+  }
+
+  // Options unknown to this FFmpeg version are left in the dictionary and ignored
+  int err = avcodec_open2(ctx, codec, &options);
+  av_dict_free(&options);
+  if (err < 0) {
+    printf("Couldn't open codec: %s\n", codec->name);
+    avcodec_free_context(&ctx);
+    return NULL;
+  }
+
+  return ctx;
+}
 
 // This function must be called before
 // any other decoding functions
-int ffmpeg_init(int videoFormat, int width, int height, int perf_lvl, int buffer_count, int thread_count) {
+PFFMPEG_CONTEXT ffmpeg_init(int videoFormat, int width, int height, int perf_lvl, int buffer_count, int thread_count, const char* cache_dir, FFmpegGetBuffer get_buffer) {
   // Initialize the avcodec library and register codecs
   av_log_set_level(AV_LOG_QUIET);
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58,10,100)
   avcodec_register_all();
 #endif
 
-  pkt = av_packet_alloc();
-  if (pkt == NULL) {
-    printf("Couldn't allocate packet\n");
-    return -1;
+  PFFMPEG_CONTEXT ctx = calloc(1, sizeof(FFMPEG_CONTEXT));
+  if (ctx == NULL) {
+    printf("Couldn't allocate decoder context\n");
+    return NULL;
   }
 
-  ffmpeg_decoder = perf_lvl & VAAPI_ACCELERATION ? VAAPI : SOFTWARE;
-
-  for (int try = 0; try < 6; try++) {
-    if (videoFormat & VIDEO_FORMAT_MASK_H264) {
-      if (ffmpeg_decoder == SOFTWARE) {
-        if (try == 0) decoder = avcodec_find_decoder_by_name("h264_nvv4l2"); // Tegra
-        if (try == 1) decoder = avcodec_find_decoder_by_name("h264_nvmpi"); // Tegra
-        if (try == 2) decoder = avcodec_find_decoder_by_name("h264_omx"); // VisionFive
-        if (try == 3) decoder = avcodec_find_decoder_by_name("h264_v4l2m2m"); // Stateful V4L2
-      }
-      if (try == 4) decoder = avcodec_find_decoder_by_name("h264"); // Software and hwaccel
-    } else if (videoFormat & VIDEO_FORMAT_MASK_H265) {
-      if (ffmpeg_decoder == SOFTWARE) {
-        if (try == 0) decoder = avcodec_find_decoder_by_name("hevc_nvv4l2"); // Tegra
-        if (try == 1) decoder = avcodec_find_decoder_by_name("hevc_nvmpi"); // Tegra
-        if (try == 2) decoder = avcodec_find_decoder_by_name("hevc_omx"); // VisionFive
-        if (try == 3) decoder = avcodec_find_decoder_by_name("hevc_v4l2m2m"); // Stateful V4L2
-      }
-      if (try == 4) decoder = avcodec_find_decoder_by_name("hevc"); // Software and hwaccel
-    } else if (videoFormat & VIDEO_FORMAT_MASK_AV1) {
-      if (ffmpeg_decoder == SOFTWARE) {
-        if (try == 0) decoder = avcodec_find_decoder_by_name("libdav1d");
-      }
-      if (try == 1) decoder = avcodec_find_decoder_by_name("av1"); // Hwaccel
-    } else {
-      printf("Video format not supported\n");
-      return -1;
-    }
-
-    // Skip this decoder if it isn't compiled into FFmpeg
-    if (!decoder) {
-      continue;
-    }
-
-    decoder_ctx = avcodec_alloc_context3(decoder);
-    if (decoder_ctx == NULL) {
-      printf("Couldn't allocate context\n");
-      return -1;
-    }
+  ctx->pkt = av_packet_alloc();
+  if (ctx->pkt == NULL) {
+    printf("Couldn't allocate packet\n");
+    goto fail;
+  }
 
-    // Use low delay decoding
-    decoder_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+  ctx->packet_buffer_size = INITIAL_DECODER_BUFFER_SIZE + AV_INPUT_BUFFER_PADDING_SIZE;
+  ctx->packet_pool = av_buffer_pool_init(ctx->packet_buffer_size, NULL);
+  if (ctx->packet_pool == NULL) {
+    printf("Couldn't allocate packet pool\n");
+    goto fail;
+  }
 
-    // Allow display of corrupt frames and frames missing references
-    decoder_ctx->flags |= AV_CODEC_FLAG_OUTPUT_CORRUPT;
-    decoder_ctx->flags2 |= AV_CODEC_FLAG2_SHOW_ALL;
+  ctx->decoder_type = perf_lvl & VAAPI_ACCELERATION ? VAAPI : SOFTWARE;
+
+  const char** candidates;
+  if (videoFormat & VIDEO_FORMAT_MASK_H264)
+    candidates = h264_decoders;
+  else if (videoFormat & VIDEO_FORMAT_MASK_H265)
+    candidates = hevc_decoders;
+  else if (videoFormat & VIDEO_FORMAT_MASK_AV1)
+    candidates = av1_decoders;
+  else {
+    printf("Video format not supported\n");
+    goto fail;
+  }
 
-    // Report decoding errors to allow us to request a key frame
-    decoder_ctx->err_recognition = AV_EF_EXPLODE;
+  // Only the last candidate supports hardware acceleration through hwaccel
+  int candidate_count = 0;
+  while (candidates[candidate_count] != NULL)
+    candidate_count++;
+  if (ctx->decoder_type != SOFTWARE) {
+    candidates += candidate_count - 1;
+    candidate_count = 1;
+  }
 
-    if (perf_lvl & SLICE_THREADING) {
-      decoder_ctx->thread_type = FF_THREAD_SLICE;
-      decoder_ctx->thread_count = thread_count;
-    } else {
-      decoder_ctx->thread_count = 1;
+  char fingerprint[256];
+  char cached_name[64];
+  ffmpeg_fingerprint(fingerprint, sizeof(fingerprint), videoFormat, width, height, perf_lvl);
+  bool cached = ffmpeg_cache_lookup(cache_dir, fingerprint, cached_name, sizeof(cached_name));
+  if (cached) {
+    // Only trust the cache for decoders we would have probed anyway
+    cached = false;
+    for (int i = 0; i < candidate_count; i++) {
+      if (strcmp(candidates[i], cached_name) == 0)
+        cached = true;
     }
+  }
 
-    decoder_ctx->width = width;
-    decoder_ctx->height = height;
-    decoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  if (cached) {
+    ctx->decoder = avcodec_find_decoder_by_name(cached_name);
+    if (ctx->decoder)
+      ctx->decoder_ctx = ffmpeg_open_decoder(ctx->decoder, width, height, perf_lvl, thread_count, get_buffer);
+  }
 
-    int err = avcodec_open2(decoder_ctx, decoder, NULL);
-    if (err < 0) {
-      printf("Couldn't open codec: %s\n", decoder->name);
-      avcodec_free_context(&decoder_ctx);
+  for (int i = 0; i < candidate_count && ctx->decoder_ctx == NULL; i++) {
+    if (cached && strcmp(candidates[i], cached_name) == 0)
       continue;
-    }
+
+    // Skip this decoder if it isn't compiled into FFmpeg
+    ctx->decoder = avcodec_find_decoder_by_name(candidates[i]);
+    if (!ctx->decoder)
+      continue;
+
+    ctx->decoder_ctx = ffmpeg_open_decoder(ctx->decoder, width, height, perf_lvl, thread_count, get_buffer);
   }
 
-  if (decoder == NULL) {
+  if (ctx->decoder_ctx == NULL) {
     printf("Couldn't find decoder\n");
-    return -1;
+    goto fail;
   }
 
-  printf("Using FFmpeg decoder: %s\n", decoder->name);
+  if (!cached || strcmp(cached_name, ctx->decoder->name) != 0)
+    ffmpeg_cache_store(cache_dir, fingerprint, ctx->decoder->name);
+
+  printf("Using FFmpeg decoder: %s\n", ctx->decoder->name);
+  if (ctx->decoder_ctx->active_thread_type & FF_THREAD_FRAME)
+    printf("Frame threading with %d threads adds %d frames of latency\n", ctx->decoder_ctx->thread_count, ctx->decoder_ctx->thread_count - 1);
+  else if (ctx->decoder_ctx->active_thread_type & FF_THREAD_SLICE)
+    printf("Slice threading with %d threads\n", ctx->decoder_ctx->thread_count);
 
-  dec_frames_cnt = buffer_count;
-  dec_frames = malloc(buffer_count * sizeof(AVFrame*));
-  if (dec_frames == NULL) {
+  ctx->dec_frames = calloc(buffer_count, sizeof(AVFrame*));
+  if (ctx->dec_frames == NULL) {
     fprintf(stderr, "Couldn't allocate frames");
-    return -1;
+    goto fail;
   }
+  ctx->dec_frames_cnt = buffer_count;
 
   for (int i = 0; i < buffer_count; i++) {
-    dec_frames[i] = av_frame_alloc();
-    if (dec_frames[i] == NULL) {
+    ctx->dec_frames[i] = av_frame_alloc();
+    if (ctx->dec_frames[i] == NULL) {
       fprintf(stderr, "Couldn't allocate frame");
-      return -1;
+      goto fail;
     }
   }
 
+  ctx->drain_frame = av_frame_alloc();
+  if (ctx->drain_frame == NULL) {
+    fprintf(stderr, "Couldn't allocate frame");
+    goto fail;
+  }
+
   #ifdef HAVE_VAAPI
-  if (ffmpeg_decoder == VAAPI)
-    vaapi_init(decoder_ctx);
+  if (ctx->decoder_type == VAAPI)
+    vaapi_init(ctx->decoder_ctx);
   #endif
 
-  return 0;
+  return ctx;
+
+fail:
+  ffmpeg_destroy(ctx);
+  return NULL;
 }
 
 // This function must be called after
 // decoding is finished
-void ffmpeg_destroy(void) {
-  av_packet_free(&pkt);
-  if (decoder_ctx) {
-    avcodec_free_context(&decoder_ctx);
-  }
-  if (dec_frames) {
-    for (int i = 0; i < dec_frames_cnt; i++) {
-      if (dec_frames[i])
-        av_frame_free(&dec_frames[i]);
+void ffmpeg_destroy(PFFMPEG_CONTEXT ctx) {
+  if (ctx == NULL)
+    return;
+
+  ffmpeg_stop_decode_thread(ctx);
+  av_packet_free(&ctx->pkt);
+  // Buffers still referenced by the decoder keep the pool alive until released
+  av_buffer_pool_uninit(&ctx->packet_pool);
+  if (ctx->decoder_ctx) {
+    avcodec_free_context(&ctx->decoder_ctx);
+  }
+  if (ctx->dec_frames) {
+    for (int i = 0; i < ctx->dec_frames_cnt; i++) {
+      if (ctx->dec_frames[i])
+        av_frame_free(&ctx->dec_frames[i]);
     }
+    free(ctx->dec_frames);
   }
+  av_frame_free(&ctx->drain_frame);
+
+  if (ctx->frames_skipped > 0)
+    printf("Skipped %u of %u decoded frames to present the newest frame\n", ctx->frames_skipped, ctx->frames_received);
+  if (ctx->decode_errors > 0)
+    printf("%u decode errors, %u IDR frames requested, recovered %u times in %llu ms on average (max %llu ms)\n", ctx->decode_errors, ctx->idr_requests, ctx->recoveries,
+           (unsigned long long) (ctx->recoveries > 0 ? ctx->recovery_time_total / ctx->recoveries : 0), (unsigned long long) ctx->recovery_time_max);
+  if (ctx->frames_lost > 0)
+    printf("%u frames lost, %u times recovered by reference frame invalidation\n", ctx->frames_lost, ctx->rfi_recoveries);
+
+  free(ctx);
 }
 
-AVFrame* ffmpeg_get_frame(bool native_frame) {
-  int err = avcodec_receive_frame(decoder_ctx, dec_frames[next_frame]);
-  if (err == 0) {
-    current_frame = next_frame;
-    next_frame = (current_frame+1) % dec_frames_cnt;
+// Number of the decode unit a frame was decoded from, 0 if FFmpeg can't pass it along
+int ffmpeg_frame_number(const AVFrame* frame) {
+  #ifdef AV_CODEC_FLAG_COPY_OPAQUE
+  return (int) (intptr_t) frame->opaque;
+  #else
+  return 0;
+  #endif
+}
 
-    if (ffmpeg_decoder == SOFTWARE || native_frame)
-      return dec_frames[current_frame];
-  } else if (err != AVERROR(EAGAIN)) {
+enum decoders ffmpeg_get_decoder(PFFMPEG_CONTEXT ctx) {
+  return ctx->decoder_type;
+}
+
+AVFrame* ffmpeg_get_frame(PFFMPEG_CONTEXT ctx, bool native_frame) {
+  bool received = false;
+  int err;
+
+  // Drain every frame the decoder has ready and only keep the newest,
+  // older frames would only add latency
+  while ((err = avcodec_receive_frame(ctx->decoder_ctx, ctx->drain_frame)) == 0) {
+    if (received)
+      ctx->frames_skipped++;
+
+    av_frame_unref(ctx->dec_frames[ctx->next_frame]);
+    av_frame_move_ref(ctx->dec_frames[ctx->next_frame], ctx->drain_frame);
+    ctx->frames_received++;
+    received = true;
+  }
+
+  // Decoders with a frame delay, like libdav1d or frame threading, report errors here.
+  // The submit call already returned, so a key frame is requested with the next unit.
+  if (err != AVERROR(EAGAIN) && err != AVERROR_EOF) {
     char errorstring[512];
     av_strerror(err, errorstring, sizeof(errorstring));
     fprintf(stderr, "Receive failed - %d/%s\n", err, errorstring);
+
+    if (ffmpeg_decode_error(ctx) == DR_NEED_IDR)
+      __atomic_store_n(&ctx->need_idr, true, __ATOMIC_RELEASE);
+  }
+
+  // Only a frame from after the gap which decoded without error shows the host recovered
+  if (received && err == AVERROR(EAGAIN) && ctx->rfi_frame != 0 && !ctx->rfi_recovered && ctx->rfi_errors == 0) {
+    int frame_number = ffmpeg_frame_number(ctx->dec_frames[ctx->next_frame]);
+    if (frame_number == 0 || frame_number >= ctx->rfi_frame) {
+      ctx->rfi_recoveries++;
+      ctx->rfi_recovered = true;
+      if (ctx->error_time != 0)
+        ctx->recovery_frame = true;
+    }
+  }
+
+  if (received && ctx->recovery_frame) {
+    uint64_t recovery_time = LiGetMillis() - ctx->error_time;
+    printf("Recovered from decode error in %llu ms\n", (unsigned long long) recovery_time);
+    ctx->recovery_time_total += recovery_time;
+    if (recovery_time > ctx->recovery_time_max)
+      ctx->recovery_time_max = recovery_time;
+
+    ctx->recoveries++;
+    ctx->error_time = 0;
+    ctx->recovery_frame = false;
+  }
+
+  if (received) {
+    ctx->current_frame = ctx->next_frame;
+    ctx->next_frame = (ctx->current_frame+1) % ctx->dec_frames_cnt;
+
+    if (ctx->decoder_type == SOFTWARE || native_frame)
+      return ctx->dec_frames[ctx->current_frame];
   }
   return NULL;
 }
 
-// packets must be decoded in order
-// indata must be inlen + AV_INPUT_BUFFER_PADDING_SIZE in length
-int ffmpeg_decode(unsigned char* indata, int inlen) {
-  int err;
+static int ffmpeg_fill_packet(PFFMPEG_CONTEXT ctx, AVPacket* packet, PDECODE_UNIT decodeUnit) {
+  size_t required_size = decodeUnit->fullLength + AV_INPUT_BUFFER_PADDING_SIZE;
+  if (required_size > ctx->packet_buffer_size) {
+    // Buffers from the old pool stay valid until the decoder releases them
+    av_buffer_pool_uninit(&ctx->packet_pool);
+    while (ctx->packet_buffer_size < required_size)
+      ctx->packet_buffer_size *= 2;
+
+    ctx->packet_pool = av_buffer_pool_init(ctx->packet_buffer_size, NULL);
+  }
+
+  AVBufferRef* buf = ctx->packet_pool != NULL ? av_buffer_pool_get(ctx->packet_pool) : NULL;
+  if (buf == NULL) {
+    fprintf(stderr, "Couldn't allocate %zu bytes for packet\n", ctx->packet_buffer_size);
+    return AVERROR(ENOMEM);
+  }
 
-  pkt->data = indata;
-  pkt->size = inlen;
+  int length = 0;
+  for (PLENTRY entry = decodeUnit->bufferList; entry != NULL; entry = entry->next) {
+    memcpy(buf->data + length, entry->data, entry->length);
+    length += entry->length;
+  }
+  memset(buf->data + length, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+  // The packet takes ownership of the buffer reference
+  packet->buf = buf;
+  packet->data = buf->data;
+  packet->size = length;
+  packet->flags = decodeUnit->frameType == FRAME_TYPE_IDR ? AV_PKT_FLAG_KEY : 0;
+  packet->pts = decodeUnit->presentationTimeMs;
+  packet->dts = AV_NOPTS_VALUE;
+  #ifdef AV_CODEC_FLAG_COPY_OPAQUE
+  packet->opaque = (void*) (intptr_t) decodeUnit->frameNumber;
+  #endif
+
+  return 0;
+}
 
-  err = avcodec_send_packet(decoder_ctx, pkt);
+static int ffmpeg_send_packet(PFFMPEG_CONTEXT ctx, AVPacket* packet) {
+  int err = avcodec_send_packet(ctx->decoder_ctx, packet);
+  av_packet_unref(packet);
   if (err < 0) {
     char errorstring[512];
     av_strerror(err, errorstring, sizeof(errorstring));
@@ -206,3 +617,183 @@ int ffmpeg_decode(unsigned char* indata, int inlen) {
 
   return err < 0 ? err : 0;
 }
+
+// Returns DR_NEED_IDR if a key frame should be requested to recover
+static int ffmpeg_decode_error(PFFMPEG_CONTEXT ctx) {
+  uint64_t now = LiGetMillis();
+
+  ctx->decode_errors++;
+  if (ctx->error_time == 0)
+    ctx->error_time = now;
+  ctx->recovery_frame = false;
+
+  // Give the host a chance to recover without a key frame, unless errors persist
+  if (ctx->rfi_frame != 0 && ++ctx->rfi_errors <= RFI_MAX_ERRORS)
+    return DR_OK;
+  ctx->rfi_frame = 0;
+
+  // Only ask again if the previous request didn't result in an IDR frame in time
+  if (ctx->idr_request_time != 0 && now - ctx->idr_request_time < IDR_REQUEST_TIMEOUT_MS)
+    return DR_OK;
+
+  ctx->idr_request_time = now;
+  ctx->idr_requests++;
+  return DR_NEED_IDR;
+}
+
+// Frame numbers are in decode order, gaps are used to detect lost frames
+static int ffmpeg_decode_packet(PFFMPEG_CONTEXT ctx, AVPacket* packet, int frame_number) {
+  bool key_frame = packet->flags & AV_PKT_FLAG_KEY;
+
+  if (ctx->last_frame_number != 0 && frame_number > ctx->last_frame_number + 1 && !key_frame) {
+    ctx->frames_lost += frame_number - ctx->last_frame_number - 1;
+    ctx->rfi_frame = frame_number;
+    ctx->rfi_errors = 0;
+    ctx->rfi_recovered = false;
+  }
+  ctx->last_frame_number = frame_number;
+  if (ctx->rfi_frame != 0 && frame_number - ctx->rfi_frame >= RFI_WINDOW_FRAMES)
+    ctx->rfi_frame = 0;
+
+  if (ffmpeg_send_packet(ctx, packet) < 0)
+    return ffmpeg_decode_error(ctx);
+
+  if (key_frame) {
+    ctx->idr_request_time = 0;
+    ctx->rfi_frame = 0;
+    if (ctx->error_time != 0)
+      ctx->recovery_frame = true;
+  }
+
+  return DR_OK;
+}
+
+// packets must be decoded in order
+int ffmpeg_decode_unit(PFFMPEG_CONTEXT ctx, PDECODE_UNIT decodeUnit) {
+  if (ffmpeg_fill_packet(ctx, ctx->pkt, decodeUnit) < 0)
+    return DR_NEED_IDR;
+
+  int ret = ffmpeg_decode_packet(ctx, ctx->pkt, decodeUnit->frameNumber);
+  if (__atomic_exchange_n(&ctx->need_idr, false, __ATOMIC_ACQ_REL))
+    ret = DR_NEED_IDR;
+
+  return ret;
+}
+
+static void* ffmpeg_decode_thread(void* data) {
+  PFFMPEG_CONTEXT ctx = data;
+
+  while (true) {
+    sem_wait(&ctx->decode_queue_sem);
+    if (__atomic_load_n(&ctx->decode_thread_stop, __ATOMIC_ACQUIRE))
+      break;
+
+    unsigned int tail = ctx->decode_queue_tail;
+    AVPacket* packet = ctx->decode_queue[tail % ctx->decode_queue_depth];
+
+    // Units queued before an overflow are useless without the IDR frame which follows
+    if ((int) (tail - __atomic_load_n(&ctx->decode_queue_flush, __ATOMIC_ACQUIRE)) < 0)
+      av_packet_unref(packet);
+    else {
+      // The request is returned with the next unit queued by the receive thread
+      if (ffmpeg_decode_packet(ctx, packet, ctx->decode_queue_frames[tail % ctx->decode_queue_depth]) == DR_NEED_IDR)
+        __atomic_store_n(&ctx->need_idr, true, __ATOMIC_RELEASE);
+
+      ctx->decoded_handler(ctx);
+    }
+
+    __atomic_store_n(&ctx->decode_queue_tail, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+int ffmpeg_start_decode_thread(PFFMPEG_CONTEXT ctx, int queue_depth, void (*handler)(PFFMPEG_CONTEXT ctx)) {
+  ctx->decode_queue = calloc(queue_depth, sizeof(AVPacket*));
+  ctx->decode_queue_frames = calloc(queue_depth, sizeof(int));
+  if (ctx->decode_queue == NULL || ctx->decode_queue_frames == NULL) {
+    fprintf(stderr, "Couldn't allocate decode queue\n");
+    return -1;
+  }
+  ctx->decode_queue_depth = queue_depth;
+
+  for (int i = 0; i < queue_depth; i++) {
+    ctx->decode_queue[i] = av_packet_alloc();
+    if (ctx->decode_queue[i] == NULL) {
+      fprintf(stderr, "Couldn't allocate packet\n");
+      return -1;
+    }
+  }
+
+  ctx->decode_queue_head = ctx->decode_queue_tail = ctx->decode_queue_flush = 0;
+  ctx->decode_thread_stop = false;
+  ctx->waiting_for_idr = false;
+  ctx->decoded_handler = handler;
+  sem_init(&ctx->decode_queue_sem, 0, 0);
+
+  if (pthread_create(&ctx->decode_thread, NULL, ffmpeg_decode_thread, ctx) != 0) {
+    fprintf(stderr, "Couldn't start decode thread\n");
+    sem_destroy(&ctx->decode_queue_sem);
+    return -1;
+  }
+  ctx->decode_thread_started = true;
+
+  return 0;
+}
+
+void ffmpeg_stop_decode_thread(PFFMPEG_CONTEXT ctx) {
+  if (ctx->decode_thread_started) {
+    __atomic_store_n(&ctx->decode_thread_stop, true, __ATOMIC_RELEASE);
+    sem_post(&ctx->decode_queue_sem);
+    pthread_join(ctx->decode_thread, NULL);
+    sem_destroy(&ctx->decode_queue_sem);
+    ctx->decode_thread_started = false;
+  }
+
+  if (ctx->decode_queue) {
+    for (int i = 0; i < ctx->decode_queue_depth; i++)
+      av_packet_free(&ctx->decode_queue[i]);
+
+    free(ctx->decode_queue);
+    ctx->decode_queue = NULL;
+  }
+  free(ctx->decode_queue_frames);
+  ctx->decode_queue_frames = NULL;
+}
+
+// Only the receive thread may queue units, the decode thread is the only consumer
+int ffmpeg_queue_decode_unit(PFFMPEG_CONTEXT ctx, PDECODE_UNIT decodeUnit) {
+  unsigned int head = ctx->decode_queue_head;
+  bool idr = decodeUnit->frameType == FRAME_TYPE_IDR;
+
+  // Everything up to the next IDR frame depends on the units we dropped
+  if (ctx->waiting_for_idr && !idr)
+    return DR_OK;
+
+  if (head - __atomic_load_n(&ctx->decode_queue_tail, __ATOMIC_ACQUIRE) >= ctx->decode_queue_depth) {
+    if (!ctx->waiting_for_idr)
+      fprintf(stderr, "Decode queue overflow, dropping frames until next IDR frame\n");
+
+    // Let the decoder skip the stale backlog, so there is room when the IDR frame arrives
+    __atomic_store_n(&ctx->decode_queue_flush, head, __ATOMIC_RELEASE);
+    ctx->waiting_for_idr = true;
+    return DR_NEED_IDR;
+  }
+
+  if (ffmpeg_fill_packet(ctx, ctx->decode_queue[head % ctx->decode_queue_depth], decodeUnit) < 0)
+    return DR_NEED_IDR;
+  ctx->decode_queue_frames[head % ctx->decode_queue_depth] = decodeUnit->frameNumber;
+
+  ctx->waiting_for_idr = false;
+  __atomic_store_n(&ctx->decode_queue_head, head + 1, __ATOMIC_RELEASE);
+  sem_post(&ctx->decode_queue_sem);
+
+  return __atomic_exchange_n(&ctx->need_idr, false, __ATOMIC_ACQ_REL) ? DR_NEED_IDR : DR_OK;
+}
+
+int ffmpeg_queued_units(PFFMPEG_CONTEXT ctx) {
+  if (ctx->decode_queue == NULL)
+    return 0;
+
+  return __atomic_load_n(&ctx->decode_queue_head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ctx->decode_queue_tail, __ATOMIC_ACQUIRE);
+}
@@ -19,20 +19,40 @@
 
 #include <stdbool.h>
 
+#include <Limelight.h>
 #include <libavcodec/avcodec.h>
 
 // Enable multi-threaded decoding
 #define SLICE_THREADING 0x4
+#define FRAME_THREADING 0x8
 // Uses hardware acceleration
 #define VDPAU_ACCELERATION 0x40
 #define VAAPI_ACCELERATION 0x80
 
 enum decoders {SOFTWARE, VDPAU, VAAPI};
-extern enum decoders ffmpeg_decoder;
 
-int ffmpeg_init(int videoFormat, int width, int height, int perf_lvl, int buffer_count, int thread_count);
-void ffmpeg_destroy(void);
+// All decoder state lives in the context, so several decoders can run side by side
+typedef struct _FFMPEG_CONTEXT FFMPEG_CONTEXT, *PFFMPEG_CONTEXT;
 
+// Buffer allocator for software decoders
+typedef int (*FFmpegGetBuffer)(AVCodecContext* ctx, AVFrame* frame, int flags);
+
+int ffmpeg_threading(int videoFormat, int width, int height, int fps, int* thread_count);
+int ffmpeg_slices_per_frame(int videoFormats, int width, int height, int fps, enum decoders decoder);
+bool ffmpeg_prefers_av1(int width, int height, int fps);
+
+// cache_dir remembers the decoder which worked for a stream, NULL to always probe.
+// Without get_buffer libavcodec allocates frames itself.
+PFFMPEG_CONTEXT ffmpeg_init(int videoFormat, int width, int height, int perf_lvl, int buffer_count, int thread_count, const char* cache_dir, FFmpegGetBuffer get_buffer);
+void ffmpeg_destroy(PFFMPEG_CONTEXT ctx);
+
+enum decoders ffmpeg_get_decoder(PFFMPEG_CONTEXT ctx);
+int ffmpeg_frame_number(const AVFrame* frame);
 int ffmpeg_draw_frame(AVFrame *pict);
-AVFrame* ffmpeg_get_frame(bool native_frame);
-int ffmpeg_decode(unsigned char* indata, int inlen);
+AVFrame* ffmpeg_get_frame(PFFMPEG_CONTEXT ctx, bool native_frame);
+int ffmpeg_decode_unit(PFFMPEG_CONTEXT ctx, PDECODE_UNIT decodeUnit);
+
+int ffmpeg_start_decode_thread(PFFMPEG_CONTEXT ctx, int queue_depth, void (*handler)(PFFMPEG_CONTEXT ctx));
+void ffmpeg_stop_decode_thread(PFFMPEG_CONTEXT ctx);
+int ffmpeg_queue_decode_unit(PFFMPEG_CONTEXT ctx, PDECODE_UNIT decodeUnit);
+int ffmpeg_queued_units(PFFMPEG_CONTEXT ctx);
@@ -0,0 +1,278 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pacer.h"
+
+#include <Limelight.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PACER_QUEUE_SIZE 8
+// Timing statistics are kept over two windows of this length
+#define PACER_WINDOW_MS 1000
+// Share of the phase error to the presented refreshes corrected on each tick
+#define PACER_LOCK_GAIN 4
+// The correction per tick is at most this share of the interval, so a bad time source can't drag the phase
+#define PACER_LOCK_LIMIT 64
+// Presents are only trusted as refreshes when they follow the previous one by an interval within this share
+#define PACER_VSYNC_TOLERANCE 8
+// Frames are handed to the renderer this long after the refresh, to be drawn for the next one
+#define PACER_VSYNC_OFFSET_NS 1000000
+
+static pthread_t pacer_thread;
+static pthread_mutex_t pacer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool pacer_started, pacer_stop;
+static void (*pacer_handler)(void);
+static long pacer_interval_ns;
+static uint64_t vsync_ns;
+
+// Decoded frames waiting for their presentation time
+static AVFrame* queue[PACER_QUEUE_SIZE];
+static int64_t queue_due[PACER_QUEUE_SIZE];
+static uint64_t queue_arrival[PACER_QUEUE_SIZE];
+static int queue_head, queue_count;
+
+// Frame selected for the current refresh and the frames handed to the renderer
+static AVFrame* ready_frame;
+static AVFrame** out_frames;
+static int out_frames_cnt, out_next;
+
+// Offset between the host and local clock and the jitter on top of it
+static uint64_t window_start;
+static int64_t window_min[2], window_max[2];
+static int64_t max_delay_ms;
+
+static unsigned int frames_presented, frames_dropped, frames_late;
+static uint64_t delay_total;
+
+static void pacer_drop_oldest(void) {
+  av_frame_unref(queue[queue_head]);
+  queue_head = (queue_head + 1) % PACER_QUEUE_SIZE;
+  queue_count--;
+  frames_dropped++;
+}
+
+static int64_t pacer_due_time(int64_t pts, uint64_t now) {
+  int64_t delta = (int64_t) now - pts;
+  if (window_start == 0 || now - window_start >= PACER_WINDOW_MS) {
+    if (window_start == 0)
+      window_min[1] = window_max[1] = delta;
+    else {
+      window_min[1] = window_min[0];
+      window_max[1] = window_max[0];
+    }
+    window_min[0] = window_max[0] = delta;
+    window_start = now;
+  } else if (delta < window_min[0])
+    window_min[0] = delta;
+  else if (delta > window_max[0])
+    window_max[0] = delta;
+
+  // Frames arriving with the least delay define the clock offset, the spread above it the buffer depth
+  int64_t offset = window_min[0] < window_min[1] ? window_min[0] : window_min[1];
+  int64_t jitter = (window_max[0] > window_max[1] ? window_max[0] : window_max[1]) - offset;
+  if (jitter > max_delay_ms)
+    jitter = max_delay_ms;
+
+  return pts + offset + jitter;
+}
+
+void pacer_submit(AVFrame* frame) {
+  if (frame == NULL)
+    return;
+
+  uint64_t now = LiGetMillis();
+  pthread_mutex_lock(&pacer_mutex);
+  if (queue_count == PACER_QUEUE_SIZE)
+    pacer_drop_oldest();
+
+  int slot = (queue_head + queue_count) % PACER_QUEUE_SIZE;
+  if (av_frame_ref(queue[slot], frame) == 0) {
+    queue_due[slot] = frame->pts != AV_NOPTS_VALUE ? pacer_due_time(frame->pts, now) : (int64_t) now;
+    queue_arrival[slot] = now;
+    queue_count++;
+  }
+  pthread_mutex_unlock(&pacer_mutex);
+}
+
+AVFrame* pacer_get_frame(void) {
+  AVFrame* frame = NULL;
+
+  pthread_mutex_lock(&pacer_mutex);
+  if (ready_frame->buf[0] != NULL) {
+    frame = out_frames[out_next];
+    av_frame_unref(frame);
+    av_frame_move_ref(frame, ready_frame);
+    out_next = (out_next + 1) % out_frames_cnt;
+  }
+  pthread_mutex_unlock(&pacer_mutex);
+
+  return frame;
+}
+
+void pacer_vsync(uint64_t present_ns) {
+  if (present_ns != 0)
+    __atomic_store_n(&vsync_ns, present_ns, __ATOMIC_RELAXED);
+}
+
+static void* pacer_thread_run(void* data) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t tick = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  uint64_t locked_vsync = 0, previous_vsync = 0;
+
+  while (!__atomic_load_n(&pacer_stop, __ATOMIC_ACQUIRE)) {
+    tick += pacer_interval_ns;
+
+    // Without a vblank timestamp from EGL or SDL the measured present times stand in for the refreshes
+    uint64_t vsync = __atomic_load_n(&vsync_ns, __ATOMIC_RELAXED);
+    if (vsync != locked_vsync) {
+      int64_t spacing = vsync - previous_vsync;
+      bool refresh = previous_vsync != 0 && llabs(spacing - pacer_interval_ns) <= pacer_interval_ns / PACER_VSYNC_TOLERANCE;
+      previous_vsync = locked_vsync = vsync;
+
+      if (refresh && tick > vsync + PACER_VSYNC_OFFSET_NS) {
+        int64_t error = (tick - vsync - PACER_VSYNC_OFFSET_NS) % pacer_interval_ns;
+        if (error > pacer_interval_ns / 2)
+          error -= pacer_interval_ns;
+
+        int64_t correction = error / PACER_LOCK_GAIN;
+        int64_t limit = pacer_interval_ns / PACER_LOCK_LIMIT;
+        if (correction > limit)
+          correction = limit;
+        else if (correction < -limit)
+          correction = -limit;
+        tick -= correction;
+      }
+    }
+
+    ts.tv_sec = tick / 1000000000;
+    ts.tv_nsec = tick % 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+    // Show the newest frame which is due before the next refresh, older ones are too late
+    int64_t now = LiGetMillis();
+    int64_t deadline = now + pacer_interval_ns / 2000000;
+    bool present = false;
+    int64_t due = 0;
+    uint64_t arrival = 0;
+
+    pthread_mutex_lock(&pacer_mutex);
+    while (queue_count > 0 && queue_due[queue_head] <= deadline) {
+      // Either superseded in this refresh or the renderer didn't pick it up yet
+      if (ready_frame->buf[0] != NULL) {
+        av_frame_unref(ready_frame);
+        frames_dropped++;
+      }
+
+      due = queue_due[queue_head];
+      arrival = queue_arrival[queue_head];
+      av_frame_move_ref(ready_frame, queue[queue_head]);
+      queue_head = (queue_head + 1) % PACER_QUEUE_SIZE;
+      queue_count--;
+      present = true;
+    }
+
+    if (present) {
+      frames_presented++;
+      delay_total += now - arrival;
+      if (now - due > pacer_interval_ns / 1000000)
+        frames_late++;
+    }
+    pthread_mutex_unlock(&pacer_mutex);
+
+    if (present)
+      pacer_handler();
+  }
+
+  return NULL;
+}
+
+int pacer_init(int redraw_rate, int buffer_count, void (*handler)(void)) {
+  if (redraw_rate <= 0)
+    redraw_rate = 60;
+
+  for (int i = 0; i < PACER_QUEUE_SIZE; i++) {
+    if ((queue[i] = av_frame_alloc()) == NULL) {
+      fprintf(stderr, "Couldn't allocate frame\n");
+      return -1;
+    }
+  }
+
+  out_frames = calloc(buffer_count, sizeof(AVFrame*));
+  if (out_frames == NULL || (ready_frame = av_frame_alloc()) == NULL) {
+    fprintf(stderr, "Couldn't allocate frames\n");
+    return -1;
+  }
+  for (int i = 0; i < buffer_count; i++) {
+    if ((out_frames[i] = av_frame_alloc()) == NULL) {
+      fprintf(stderr, "Couldn't allocate frame\n");
+      return -1;
+    }
+  }
+
+  out_frames_cnt = buffer_count;
+  out_next = 0;
+  queue_head = queue_count = 0;
+  window_start = 0;
+  vsync_ns = 0;
+  pacer_interval_ns = 1000000000L / redraw_rate;
+  // Never buffer more than the queue can hold
+  max_delay_ms = (PACER_QUEUE_SIZE - 2) * 1000 / redraw_rate;
+  frames_presented = frames_dropped = frames_late = 0;
+  delay_total = 0;
+  pacer_handler = handler;
+  pacer_stop = false;
+
+  if (pthread_create(&pacer_thread, NULL, pacer_thread_run, NULL) != 0) {
+    fprintf(stderr, "Couldn't start frame pacing thread\n");
+    return -1;
+  }
+  pacer_started = true;
+
+  return 0;
+}
+
+void pacer_destroy(void) {
+  if (pacer_started) {
+    __atomic_store_n(&pacer_stop, true, __ATOMIC_RELEASE);
+    pthread_join(pacer_thread, NULL);
+    pacer_started = false;
+
+    if (frames_presented > 0)
+      printf("Paced %u frames held for %llu ms on average, %u dropped, %u late\n", frames_presented,
+             (unsigned long long) (delay_total / frames_presented), frames_dropped, frames_late);
+  }
+
+  for (int i = 0; i < PACER_QUEUE_SIZE; i++)
+    av_frame_free(&queue[i]);
+
+  if (out_frames) {
+    for (int i = 0; i < out_frames_cnt; i++)
+      av_frame_free(&out_frames[i]);
+
+    free(out_frames);
+    out_frames = NULL;
+  }
+  av_frame_free(&ready_frame);
+}
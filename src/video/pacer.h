@@ -0,0 +1,31 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libavcodec/avcodec.h>
+
+// Present frames on a refresh clock at the time the host captured them, with a small adaptive jitter buffer
+int pacer_init(int redraw_rate, int buffer_count, void (*handler)(void));
+void pacer_destroy(void);
+
+void pacer_submit(AVFrame* frame);
+AVFrame* pacer_get_frame(void);
+
+// Called by the renderer with the CLOCK_MONOTONIC time in ns a frame was presented on a refresh of the
+// display, the refresh clock is phase locked to it
+void pacer_vsync(uint64_t present_ns);
@@ -19,69 +19,100 @@
 
 #include "video.h"
 #include "ffmpeg.h"
+#include "pacer.h"
 
 #include "../sdl.h"
-#include "../util.h"
 
 #include <SDL.h>
-#include <SDL_thread.h>
 
 #include <unistd.h>
 #include <stdbool.h>
 
-#define SLICES_PER_FRAME 4
+static PFFMPEG_CONTEXT decoder;
+static int queue_depth;
+static bool pacing;
+static bool texture_decoding;
+
+// Both the pacer and the render loop keep their own reference, so the decoder can reuse its frames
+static void sdl_frame_decoded(PFFMPEG_CONTEXT ctx) {
+  if (pacing)
+    pacer_submit(ffmpeg_get_frame(ctx, false));
+  else
+    sdl_queue_frame(ffmpeg_get_frame(ctx, false));
+}
+
+static void sdl_frame_paced() {
+  sdl_queue_frame(pacer_get_frame());
+}
 
-static void* ffmpeg_buffer;
-static size_t ffmpeg_buffer_size;
+static void sdl_cleanup();
 
 static int sdl_setup(int videoFormat, int width, int height, int redrawRate, void* context, int drFlags) {
-  if (ffmpeg_init(videoFormat, width, height, SLICE_THREADING, SDL_BUFFER_FRAMES, SLICES_PER_FRAME) < 0) {
+  // Setup runs on the thread which runs the render loop, as the textures have to be locked there
+  texture_decoding = false;
+  if (drFlags & DECODE_TO_TEXTURE) {
+    texture_decoding = sdl_texture_pool_init(width, height) == 0;
+    if (!texture_decoding)
+      fprintf(stderr, "Couldn't create textures to decode into, copying frames instead\n");
+  }
+
+  int thread_count;
+  int avc_flags = ffmpeg_threading(videoFormat, width, height, redrawRate, &thread_count);
+  decoder = ffmpeg_init(videoFormat, width, height, avc_flags, SDL_BUFFER_FRAMES, thread_count, context, texture_decoding ? sdl_get_texture_buffer : NULL);
+  if (decoder == NULL) {
     fprintf(stderr, "Couldn't initialize video decoding\n");
-    return -1;
+    goto fail;
+  }
+
+  pacing = drFlags & FRAME_PACING;
+  if (pacing && pacer_init(redrawRate, SDL_BUFFER_FRAMES, sdl_frame_paced) < 0) {
+    fprintf(stderr, "Couldn't initialize frame pacing\n");
+    goto fail;
   }
 
-  ensure_buf_size(&ffmpeg_buffer, &ffmpeg_buffer_size, INITIAL_DECODER_BUFFER_SIZE + AV_INPUT_BUFFER_PADDING_SIZE);
+  queue_depth = (drFlags & DECODE_QUEUE_MASK) >> DECODE_QUEUE_SHIFT;
+  if (queue_depth > 0 && ffmpeg_start_decode_thread(decoder, queue_depth, sdl_frame_decoded) < 0) {
+    fprintf(stderr, "Couldn't start decode thread\n");
+    goto fail;
+  }
 
   return 0;
+
+fail:
+  sdl_cleanup();
+  return -1;
 }
 
 static void sdl_cleanup() {
-  ffmpeg_destroy();
-}
+  // The decode thread hands frames to the pacer, it's stopped first
+  if (decoder != NULL)
+    ffmpeg_stop_decode_thread(decoder);
 
-static int sdl_submit_decode_unit(PDECODE_UNIT decodeUnit) {
-  PLENTRY entry = decodeUnit->bufferList;
-  int length = 0;
+  pacer_destroy();
+  pacing = false;
 
-  ensure_buf_size(&ffmpeg_buffer, &ffmpeg_buffer_size, decodeUnit->fullLength + AV_INPUT_BUFFER_PADDING_SIZE);
+  ffmpeg_destroy(decoder);
+  decoder = NULL;
 
-  while (entry != NULL) {
-    memcpy(ffmpeg_buffer+length, entry->data, entry->length);
-    length += entry->length;
-    entry = entry->next;
-  }
-  ffmpeg_decode(ffmpeg_buffer, length);
-
-  SDL_LockMutex(mutex);
-  AVFrame* frame = ffmpeg_get_frame(false);
-  if (frame != NULL) {
-    sdlNextFrame++;
-
-    SDL_Event event;
-    event.type = SDL_USEREVENT;
-    event.user.code = SDL_CODE_FRAME;
-    event.user.data1 = &frame->data;
-    event.user.data2 = &frame->linesize;
-    SDL_PushEvent(&event);
+  if (texture_decoding) {
+    texture_decoding = false;
+    sdl_texture_pool_destroy();
   }
-  SDL_UnlockMutex(mutex);
+}
+
+static int sdl_submit_decode_unit(PDECODE_UNIT decodeUnit) {
+  if (queue_depth > 0)
+    return ffmpeg_queue_decode_unit(decoder, decodeUnit);
+
+  int ret = ffmpeg_decode_unit(decoder, decodeUnit);
+  sdl_frame_decoded(decoder);
 
-  return DR_OK;
+  return ret;
 }
 
 DECODER_RENDERER_CALLBACKS decoder_callbacks_sdl = {
   .setup = sdl_setup,
   .cleanup = sdl_cleanup,
   .submitDecodeUnit = sdl_submit_decode_unit,
-  .capabilities = CAPABILITY_SLICES_PER_FRAME(SLICES_PER_FRAME) | CAPABILITY_REFERENCE_FRAME_INVALIDATION_HEVC | CAPABILITY_DIRECT_SUBMIT,
+  .capabilities = CAPABILITY_REFERENCE_FRAME_INVALIDATION_AVC | CAPABILITY_REFERENCE_FRAME_INVALIDATION_HEVC | CAPABILITY_REFERENCE_FRAME_INVALIDATION_AV1 | CAPABILITY_DIRECT_SUBMIT,
 };
@@ -28,6 +28,18 @@
 #define DISPLAY_ROTATE_90 8
 #define DISPLAY_ROTATE_180 16
 #define DISPLAY_ROTATE_270 24
+#define DECODE_QUEUE_MASK 0xF00
+#define DECODE_QUEUE_SHIFT 8
+#define DECODE_QUEUE_MAX 15
+#define FRAME_PACING 0x1000
+#define VSYNC_MASK 0x6000
+#define VSYNC_SHIFT 13
+#define DECODE_TO_TEXTURE 0x8000
+
+#define VSYNC_DEFAULT 0
+#define VSYNC_OFF 1
+#define VSYNC_ON 2
+#define VSYNC_ADAPTIVE 3
 
 #define INIT_EGL 1
 #define INIT_VDPAU 2
@@ -48,3 +60,8 @@ extern DECODER_RENDERER_CALLBACKS decoder_callbacks_x11_vdpau;
 #ifdef HAVE_SDL
 extern DECODER_RENDERER_CALLBACKS decoder_callbacks_sdl;
 #endif
+#if defined(HAVE_SDL) || defined(HAVE_X11)
+extern DECODER_RENDERER_CALLBACKS decoder_callbacks_fake;
+// Called with the frame number of every frame decoded by the fake renderer
+extern void (*fake_frame_handler)(int frameNumber);
+#endif
@@ -20,13 +20,12 @@
 #include "video.h"
 #include "egl.h"
 #include "ffmpeg.h"
+#include "pacer.h"
 #ifdef HAVE_VAAPI
 #include "ffmpeg_vaapi.h"
 #endif
 
 #include "../input/x11.h"
-#include "../loop.h"
-#include "../util.h"
 
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
@@ -34,38 +33,103 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <poll.h>
+#include <pthread.h>
 
 #define X11_VDPAU_ACCELERATION ENABLE_HARDWARE_ACCELERATION_1
 #define X11_VAAPI_ACCELERATION ENABLE_HARDWARE_ACCELERATION_2
-#define SLICES_PER_FRAME 4
-
-static void* ffmpeg_buffer = NULL;
-static size_t ffmpeg_buffer_size = 0;
 
 static Display *display = NULL;
 static Window window;
 
-static int pipefd[2];
-
 static int display_width;
 static int display_height;
 
-static int frame_handle(int pipefd) {
-  AVFrame* frame = NULL;
-  while (read(pipefd, &frame, sizeof(void*)) > 0);
-  if (frame) {
-    if (ffmpeg_decoder == SOFTWARE)
-      egl_draw(frame->data);
+static PFFMPEG_CONTEXT decoder;
+static enum decoders decoder_type;
+static int queue_depth;
+static bool pacing;
+static bool egl_active;
+
+// Frames are handed to the render thread through three frames, so drawing and swapping never block the
+// input loop or the decoder: the sender fills the spare frame and swaps it with the pending one, the
+// render thread swaps the pending frame with the one it draws. Each frame holds its own reference.
+static pthread_t render_thread;
+static pthread_mutex_t mailbox_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mailbox_cond = PTHREAD_COND_INITIALIZER;
+static AVFrame *spare_frame, *pending_frame, *drawing_frame;
+static bool frame_pending, render_stop, render_started;
+static unsigned int frames_replaced;
+
+// Only called by one thread at a time, the decoder or the pacer
+static void x11_post_frame(AVFrame* frame) {
+  if (frame == NULL || av_frame_ref(spare_frame, frame) < 0)
+    return;
+
+  pthread_mutex_lock(&mailbox_mutex);
+  AVFrame* replaced = pending_frame;
+  pending_frame = spare_frame;
+  spare_frame = replaced;
+  if (frame_pending)
+    frames_replaced++;
+  frame_pending = true;
+  pthread_cond_signal(&mailbox_cond);
+  pthread_mutex_unlock(&mailbox_mutex);
+
+  // Drop the frame which was replaced before it could be drawn
+  av_frame_unref(spare_frame);
+}
+
+static void x11_frame_decoded(PFFMPEG_CONTEXT ctx) {
+  AVFrame* frame = ffmpeg_get_frame(ctx, true);
+  if (pacing)
+    pacer_submit(frame);
+  else
+    x11_post_frame(frame);
+}
+
+static void x11_frame_paced() {
+  x11_post_frame(pacer_get_frame());
+}
+
+void x11_cleanup();
+
+static void* x11_render_thread(void* data) {
+  while (true) {
+    pthread_mutex_lock(&mailbox_mutex);
+    while (!frame_pending && !render_stop)
+      pthread_cond_wait(&mailbox_cond, &mailbox_mutex);
+
+    if (render_stop) {
+      pthread_mutex_unlock(&mailbox_mutex);
+      break;
+    }
+
+    AVFrame* frame = pending_frame;
+    pending_frame = drawing_frame;
+    drawing_frame = frame;
+    frame_pending = false;
+    pthread_mutex_unlock(&mailbox_mutex);
+
+    if (decoder_type == SOFTWARE) {
+      egl_draw(drawing_frame);
+      if (pacing)
+        pacer_vsync(egl_vsync_time());
+    }
     #ifdef HAVE_VAAPI
-    else if (ffmpeg_decoder == VAAPI)
-      vaapi_queue(frame, window, display_width, display_height);
+    else if (decoder_type == VAAPI)
+      vaapi_queue(drawing_frame, window, display_width, display_height);
     #endif
+
+    av_frame_unref(drawing_frame);
+  }
+
+  // The EGL context is current on this thread
+  if (egl_active) {
+    egl_destroy();
+    egl_active = false;
   }
 
-  return LOOP_OK;
+  return NULL;
 }
 
 int x11_init(bool vdpau, bool vaapi) {
@@ -83,8 +147,6 @@ int x11_init(bool vdpau, bool vaapi) {
 }
 
 int x11_setup(int videoFormat, int width, int height, int redrawRate, void* context, int drFlags) {
-  ensure_buf_size(&ffmpeg_buffer, &ffmpeg_buffer_size, INITIAL_DECODER_BUFFER_SIZE + AV_INPUT_BUFFER_PADDING_SIZE);
-
   if (!display) {
     fprintf(stderr, "Error: failed to open X display.\n");
     return -1;
@@ -123,31 +185,63 @@ int x11_setup(int videoFormat, int width, int height, int redrawRate, void* cont
   XFlush(display);
 
   int avc_flags;
+  int thread_count = 1;
   if (drFlags & X11_VDPAU_ACCELERATION)
     avc_flags = VDPAU_ACCELERATION;
   else if (drFlags & X11_VAAPI_ACCELERATION)
     avc_flags = VAAPI_ACCELERATION;
   else
-    avc_flags = SLICE_THREADING;
+    avc_flags = ffmpeg_threading(videoFormat, width, height, redrawRate, &thread_count);
 
-  if (ffmpeg_init(videoFormat, width, height, avc_flags, 2, SLICES_PER_FRAME) < 0) {
+  decoder = ffmpeg_init(videoFormat, width, height, avc_flags, 2, thread_count, context, NULL);
+  if (decoder == NULL) {
     fprintf(stderr, "Couldn't initialize video decoding\n");
-    return -1;
+    goto fail;
+  }
+
+  decoder_type = ffmpeg_get_decoder(decoder);
+  if (decoder_type == SOFTWARE) {
+    egl_init(display, window, width, height, redrawRate, (drFlags & VSYNC_MASK) >> VSYNC_SHIFT);
+    egl_active = true;
+  }
+
+  spare_frame = av_frame_alloc();
+  pending_frame = av_frame_alloc();
+  drawing_frame = av_frame_alloc();
+  if (spare_frame == NULL || pending_frame == NULL || drawing_frame == NULL) {
+    fprintf(stderr, "Not enough memory\n");
+    goto fail;
+  }
+
+  frame_pending = render_stop = false;
+  frames_replaced = 0;
+  if (pthread_create(&render_thread, NULL, x11_render_thread, NULL) != 0) {
+    fprintf(stderr, "Couldn't start render thread\n");
+    goto fail;
   }
+  render_started = true;
 
-  if (ffmpeg_decoder == SOFTWARE)
-    egl_init(display, window, width, height);
+  pacing = drFlags & FRAME_PACING;
+  if (pacing && pacer_init(redrawRate, 2, x11_frame_paced) < 0) {
+    fprintf(stderr, "Couldn't initialize frame pacing\n");
+    goto fail;
+  }
 
-  if (pipe(pipefd) == -1) {
-    fprintf(stderr, "Can't create communication channel between threads\n");
-    return -2;
+  queue_depth = (drFlags & DECODE_QUEUE_MASK) >> DECODE_QUEUE_SHIFT;
+  if (queue_depth > 0 && ffmpeg_start_decode_thread(decoder, queue_depth, x11_frame_decoded) < 0) {
+    fprintf(stderr, "Couldn't start decode thread\n");
+    goto fail;
   }
-  loop_add_fd(pipefd[0], &frame_handle, POLLIN);
-  fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
 
   x11_input_init(display, window);
 
   return 0;
+
+fail:
+  x11_cleanup();
+  XDestroyWindow(display, window);
+  XFlush(display);
+  return -1;
 }
 
 int x11_setup_vdpau(int videoFormat, int width, int height, int redrawRate, void* context, int drFlags) {
@@ -159,36 +253,53 @@ int x11_setup_vaapi(int videoFormat, int width, int height, int redrawRate, void
 }
 
 void x11_cleanup() {
-  ffmpeg_destroy();
-  egl_destroy();
-}
-
-int x11_submit_decode_unit(PDECODE_UNIT decodeUnit) {
-  PLENTRY entry = decodeUnit->bufferList;
-  int length = 0;
+  // Undo x11_setup in reverse order, anything not set up yet is skipped
+  if (decoder != NULL)
+    ffmpeg_stop_decode_thread(decoder);
+
+  pacer_destroy();
+  pacing = false;
+
+  if (render_started) {
+    pthread_mutex_lock(&mailbox_mutex);
+    render_stop = true;
+    pthread_cond_signal(&mailbox_cond);
+    pthread_mutex_unlock(&mailbox_mutex);
+    pthread_join(render_thread, NULL);
+    render_started = false;
+
+    if (frames_replaced > 0)
+      printf("X11: %u frames replaced by a newer frame before they were drawn\n", frames_replaced);
+  }
 
-  ensure_buf_size(&ffmpeg_buffer, &ffmpeg_buffer_size, decodeUnit->fullLength + AV_INPUT_BUFFER_PADDING_SIZE);
+  av_frame_free(&spare_frame);
+  av_frame_free(&pending_frame);
+  av_frame_free(&drawing_frame);
 
-  while (entry != NULL) {
-    memcpy(ffmpeg_buffer+length, entry->data, entry->length);
-    length += entry->length;
-    entry = entry->next;
+  if (egl_active) {
+    egl_destroy();
+    egl_active = false;
   }
 
-  ffmpeg_decode(ffmpeg_buffer, length);
+  ffmpeg_destroy(decoder);
+  decoder = NULL;
+}
+
+int x11_submit_decode_unit(PDECODE_UNIT decodeUnit) {
+  if (queue_depth > 0)
+    return ffmpeg_queue_decode_unit(decoder, decodeUnit);
 
-  AVFrame* frame = ffmpeg_get_frame(true);
-  if (frame != NULL)
-    write(pipefd[1], &frame, sizeof(void*));
+  int ret = ffmpeg_decode_unit(decoder, decodeUnit);
+  x11_frame_decoded(decoder);
 
-  return DR_OK;
+  return ret;
 }
 
 DECODER_RENDERER_CALLBACKS decoder_callbacks_x11 = {
   .setup = x11_setup,
   .cleanup = x11_cleanup,
   .submitDecodeUnit = x11_submit_decode_unit,
-  .capabilities = CAPABILITY_SLICES_PER_FRAME(SLICES_PER_FRAME) | CAPABILITY_REFERENCE_FRAME_INVALIDATION_HEVC | CAPABILITY_DIRECT_SUBMIT,
+  .capabilities = CAPABILITY_REFERENCE_FRAME_INVALIDATION_AVC | CAPABILITY_REFERENCE_FRAME_INVALIDATION_HEVC | CAPABILITY_REFERENCE_FRAME_INVALIDATION_AV1 | CAPABILITY_DIRECT_SUBMIT,
 };
 
 DECODER_RENDERER_CALLBACKS decoder_callbacks_x11_vdpau = {